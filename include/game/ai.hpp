@@ -2,9 +2,12 @@
 #define AI_HPP
 #include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <game/board.hpp>
 #include <limits>
+#include <memory>
 #include <thread>
+#include <vector>
 
 struct TableNode {
   u64 hash;
@@ -31,82 +34,181 @@ struct TableBucket {
   TableBucket() {}
 };
 
-template <int N> class TranspositionTable {
-  TableBucket _arr[N];
-  size_t members;
+// One table entry in 16 bytes: everything but the key packed into one word,
+// next to the key xor'd with that word. Both are plain atomics, so stores
+// from several search threads may interleave; a reader that picks up halves
+// of two different stores fails the key check and sees a miss instead of a
+// torn entry.
+struct TableEntry {
+  std::atomic<u64> check; // key ^ data
+  std::atomic<u64> data;  // score, best move, depth, node type and generation
+
+  static u64 pack(const TableNode &node, Score score, int generation) {
+    return (u64)(uint32_t)score | ((u64)node.bestMove.data << 32) |
+           ((u64)(uint8_t)node.depth << 48) |
+           ((u64)((node.nodeType & 3) | (generation << 2)) << 56);
+  }
+
+  static void unpack(u64 hash, u64 data, TableBucket &out) {
+    out.first.hash = hash;
+    out.second = (Score)(int32_t)(uint32_t)data;
+    out.first.bestMove.data = (uint16_t)(data >> 32);
+    out.first.depth = depthOf(data);
+    out.first.nodeType = (NodeType)((data >> 56) & 3);
+  }
+
+  static int depthOf(u64 data) { return (int8_t)(data >> 48); }
+  static int generationOf(u64 data) { return data >> 58; }
+};
+
+// Four entries on one cache line, so a probe touches a single line.
+struct alignas(64) TableCluster {
+  TableEntry entries[4];
+};
+
+// Sized at runtime, in a power of two clusters so the index is a mask of the
+// key. The memory is aligned to the cluster size, and to 2 MB where it is
+// large enough to be backed by huge pages.
+class TranspositionTable {
+  struct FreeDeleter {
+    void operator()(TableCluster *p) { std::free(p); }
+  };
+  std::unique_ptr<TableCluster, FreeDeleter> _arr;
+  u64 _mask;
+  int _generation; // of the current search, six bits are stored
 
 public:
-  TranspositionTable() { members = 0; }
+  TranspositionTable() : _mask(0), _generation(0) {}
 
-  int ppm() { return ((double)members / (double)N) * 1000.0; }
+  // halved until the allocation succeeds, std::bad_alloc and the old table
+  // kept if not even one cluster can be had
+  void resize(u64 bytes);
+  void clear();
+  int megabytes();
 
-  TableBucket *find(TableNode &node) {
-    u64 hashval = node.hash;
-    int bucketIndex = hashval % N;
-    TableBucket *bucket = _arr + bucketIndex;
-    if (bucket->first == node) {
-      return bucket;
+  // call before each search, entries from earlier ones get replaced first
+  void newSearch() { _generation = (_generation + 1) & 63; }
+
+  // start loading the cluster of a position that is about to be probed
+  void prefetch(u64 hashval) {
+#ifdef __GNUC__
+    __builtin_prefetch(_arr.get() + (hashval & _mask));
+#endif
+  }
+
+  int ppm() {
+    // share of a sample of entries written during this search
+    int samples = _mask < 1000 ? (int)_mask + 1 : 1000;
+    int used = 0;
+    for (int i = 0; i < samples; i++) {
+      for (TableEntry &entry : _arr.get()[i].entries) {
+        u64 data = entry.data.load(std::memory_order_relaxed);
+        if (data != 0 && TableEntry::generationOf(data) == _generation) {
+          used++;
+        }
+      }
     }
-    return NULL;
+    return used * 1000 / (samples * 4);
   }
 
-  TableBucket *end() { return NULL; }
+  // copies the entry for node's position into out, false if there is none
+  bool find(TableNode &node, TableBucket &out) {
+    u64 hashval = node.hash;
+    for (TableEntry &entry : _arr.get()[hashval & _mask].entries) {
+      u64 data = entry.data.load(std::memory_order_relaxed);
+      u64 check = entry.check.load(std::memory_order_relaxed);
+      if ((check ^ data) == hashval && data != 0) {
+        TableEntry::unpack(hashval, data, out);
+        return true;
+      }
+    }
+    return false;
+  }
 
   void insert(TableNode &node, Score score) {
+    // same position if it is there, else an empty entry, else the one
+    // with the least depth, counting each search of age as 8 plies less
     u64 hashval = node.hash;
-    int bucketIndex = hashval % N;
-    TableBucket *bucket = _arr + bucketIndex;
-    if (bucket->first.hash == 0) {
-      // no overwrite
-      members += 1;
-    }
-    if (node.hash == bucket->first.hash) {    // same position
-      if (node.depth < bucket->first.depth) { // already searched to higher
-                                              // depth
-        return;
+    TableEntry *replace = nullptr;
+    int worst = SCORE_MAX;
+    for (TableEntry &entry : _arr.get()[hashval & _mask].entries) {
+      u64 data = entry.data.load(std::memory_order_relaxed);
+      u64 check = entry.check.load(std::memory_order_relaxed);
+      if ((check ^ data) == hashval && data != 0) {
+        if (node.depth < TableEntry::depthOf(data) &&
+            TableEntry::generationOf(data) == _generation) {
+          return; // already searched to higher depth
+        }
+        replace = &entry;
+        break;
+      }
+      int value = -1000; // empty
+      if (data != 0) {
+        int age = (_generation - TableEntry::generationOf(data)) & 63;
+        value = TableEntry::depthOf(data) - 8 * age;
+      }
+      if (value < worst) {
+        worst = value;
+        replace = &entry;
       }
     }
-    bucket->first = node;
-    bucket->second = score;
+    u64 data = TableEntry::pack(node, score, _generation);
+    replace->check.store(hashval ^ data, std::memory_order_relaxed);
+    replace->data.store(data, std::memory_order_relaxed);
   }
 };
 
+// Iterative deepening stops at this depth, the most a saved PV holds. With
+// check extensions on top the plies still fit MAX_SEARCH_PLIES, and depths
+// stay well inside the int8_t of a table entry.
+const int MAX_SEARCH_DEPTH = 64;
+
 struct MiniTableBucket {
   u64 hash;  // position hash
   int depth; // number of plies to root saved
   std::array<Move, 64> seq;
 };
 
-template <int N> class MiniTable {
-  MiniTableBucket _arr[N];
+// Principal variations by position, one per slot. Sized at runtime like the
+// transposition table, in a power of two slots.
+class MiniTable {
+  std::vector<MiniTableBucket> _arr;
+  u64 _mask;
   int members;
 public:
-  MiniTable() {
+  MiniTable() : _mask(0), members(0) {}
+
+  void resize(u64 count) {
+    u64 slots = 1;
+    while (slots * 2 <= count) {
+      slots *= 2;
+    }
+    _arr.assign(slots, MiniTableBucket());
+    _mask = slots - 1;
     members = 0;
   }
 
   MiniTableBucket *find(u64 hashval) {
-    int bucketIndex = hashval % N;
-    MiniTableBucket *bucket = _arr + bucketIndex;
+    MiniTableBucket *bucket = &_arr[hashval & _mask];
     if (hashval == bucket->hash) {
       return bucket;
     }
     return NULL;
   }
 
-  int ppm() { return ((double)members / (double)N) * 1000.0; }
+  int ppm() { return ((double)members / (double)_arr.size()) * 1000.0; }
 
   MiniTableBucket *end() { return NULL; }
 
   void clear() {
-    for (size_t i = 0; i < N; i++) {
-      _arr[i].hash = 0;
+    for (MiniTableBucket &bucket : _arr) {
+      bucket.hash = 0;
     }
+    members = 0;
   }
 
   void insert(u64 hashval, int depth, std::array<Move, 64> *moveseq) {
-    int bucketIndex = hashval % N;
-    MiniTableBucket *bucket = _arr + bucketIndex;
+    MiniTableBucket *bucket = &_arr[hashval & _mask];
     if (bucket->hash == 0) {
       // no overwrite
       members += 1;
@@ -117,36 +219,143 @@ public:
   }
 };
 
+// What one search thread keeps to itself. Lazy SMP helpers search the same
+// root as the main thread with their own move ordering tables, so the only
+// thing the threads share is the transposition table.
+struct SearchThread {
+  KillerTable kTable;
+  HistoryTable hTable;
+  CounterMoveTable cTable;
+  bool isMain;             // only the main thread reports and saves the PV
+  std::atomic<u64> nodes; // published by rootMove after each root move
+
+  SearchThread(bool main) : isMain(main), nodes(0) { clear(); }
+
+  void clear() {
+    kTable.clear();
+    hTable.clear();
+    cTable.clear();
+  }
+};
+
+namespace PickStage {
+const int Hash = 0;
+const int CaptureInit = 1;
+const int GoodCaptures = 2;
+const int Killers = 3;
+const int Quiets = 4;
+const int BadCaptures = 5;
+const int Done = 6;
+} // namespace PickStage
+
+// Hands out the moves of one node in search order: hash move, captures and
+// promotions that don't lose material (MVV-LVA), killers and countermove,
+// quiets by history, then losing captures. Each stage is generated and
+// scored only once the previous one runs out.
+class MovePicker {
+private:
+  Board &_board;
+  Move _hashMove;
+  int _ply;
+  int _stage;
+  bool _hasHashMove;
+  int _positiveCount;
+  int _moveCount;
+
+  MoveVector<256> _captures; // captures, en passant and promotions
+  int _captureScores[256];
+  int _captureIndex;
+  MoveVector<256> _badCaptures;
+  int _badIndex;
+  Move _killers[3];
+  int _killerIndex;
+  Move _yieldedKillers[3];
+  int _yieldedKillerCount;
+  MoveVector<256> _quiets;
+  int _quietScores[256];
+  int _quietIndex;
+  bool _quietsGenerated;
+
+  void _generateCaptures();
+  void _generateQuiets();
+  bool _isYielded(Move mv);
+  bool _isKiller(Move mv);
+
+public:
+  MovePicker(Board &board, Move hashMove, int ply);
+
+  Move next(); // null once exhausted
+
+  // moves handed out before the quiet stage
+  int positiveCount() { return _positiveCount; }
+  int moveCount() { return _moveCount; }
+};
+
 namespace AI {
 int materialEvaluation(Board &board);
 int evaluation(Board &board);
 int flippedEval(Board &board);
 
-void sendPV(Board &board, int depth, Move pvMove, int nodeCount, Score score,
+void sendPV(Board &board, int depth, Move pvMove, u64 nodeCount, Score score,
             std::chrono::_V2::system_clock::time_point start);
 
-Move rootMove(Board &board, int depth, std::atomic<bool> &stop, Score &outscore,
-              Move prevPv, int &count,
+// One root search inside (alpha, beta). A score at or below alpha is a fail
+// low and one at or above beta a fail high, and either needs a re-search.
+Move rootMove(Board &board, int depth, Score alpha, Score beta,
+              std::atomic<bool> &stop, Score &outscore, Move prevPv, u64 &count,
               std::chrono::_V2::system_clock::time_point start,
               std::vector<MoveScore> &prevScores);
 
+// One iteration of iterative deepening: rootMove in an aspiration window
+// around prevScore, the score of the last iteration, widened on the side
+// that fails until the score lands inside.
+Move rootSearch(Board &board, int depth, Score prevScore,
+                std::atomic<bool> &stop, Score &outscore, Move prevPv,
+                u64 &count, std::chrono::_V2::system_clock::time_point start,
+                std::vector<MoveScore> &prevScores);
+
 Score quiescence(Board &board, int depth, int plyCount, Score alpha, Score beta,
-               std::atomic<bool> &stop, int &count, int kickoff);
+               std::atomic<bool> &stop, u64 &count, int kickoff);
 
 Score alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha, Score beta,
-                    std::atomic<bool> &stop, int &count, NodeType myNodeType,
+                    std::atomic<bool> &stop, u64 &count, NodeType myNodeType,
                     bool isSave);
 
 Score zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
-                     std::atomic<bool> &stop, int &count, NodeType myNodeType);
-
-std::vector<Move> generateMovesOrdered(Board &board, Move refMove, int plyCount,
-                                       int &numPositiveMoves);
+                     std::atomic<bool> &stop, u64 &count, NodeType myNodeType);
 
 bool isCheckmateScore(Score sc);
 
 void init();
-void reset();
+void prefetch(u64 key); // Board::prefetch hook for the boards being searched
+void reset();    // new game: forget the tables
+void newSearch(); // before each go: age the transposition table
+
+// Hash option: transposition table size, rounded down to a power of two.
+// The PV table takes one slot per 64 clusters. Both start out empty.
+void setHashSize(int megabytes);
+int hashSize();
+
+// Threads option: number of search threads, the first being the main one.
+// Only change it while no search is running.
+void setThreads(int n);
+int threadCount();
+// makes the calling thread search with the tables of thread index and
+// restarts its node count
+void bindThread(int index);
+u64 totalNodes(); // over all threads since they were last bound
+
+// Stores and probes a small table from several threads at once for millis
+// milliseconds, with entries whose contents follow from their key. Reports
+// to out and returns false if any probe hit came back with contents that
+// don't belong to its key.
+bool tableStress(int threads, int millis, std::ostream &out);
+
+// Plays the "sm" move of every position of an EPD file, which stalemates the
+// other side, and searches the stalemated node to each depth up to depth,
+// in a zero window just above the draw and in a full one. Reports to out and
+// returns false if any search scored it other than 0.
+bool stalemateSuite(const std::string &path, int depth, std::ostream &out);
 
 } // namespace AI
 
@@ -2,6 +2,7 @@
 #define DS_HPP
 
 #include <array>
+#include <stdexcept>
 #include <string.h>
 #include <vector>
 
@@ -16,9 +17,9 @@ struct MoveScore {
 struct PieceSquareTable {
   std::array<float, 64> arr;
 
-  float at(int index) { return arr[index]; }
+  constexpr float at(int index) const { return arr[index]; }
 
-  void dump() {
+  void dump() const {
     for (int row = 7; row >= 0; row--) {
       for (int col = 0; col < 8; col++) {
         std::cout << (int)(10.0 * arr[intFromPair(row, col)]) << "|";
@@ -28,112 +29,55 @@ struct PieceSquareTable {
     std::cout << "\n";
   }
 
-  void set(int index, float score) { arr[index] = score; }
+  constexpr void set(int index, float score) { arr[index] = score; }
 };
 
-struct SpecialMoveBuffer {
-  std::array<Move, 32> data; // Might overflow if given a crazy position.
-  // Haven't done the math but shouldn't happen in any legal position.
-  int size_;
-
-  SpecialMoveBuffer() { size_ = 0; }
-
-  Move back() {
-    if (size_ > 0) {
-      return data[size_ - 1];
-    } else {
-      throw;
-    }
-  }
-
-  Move pop_back() {
-    Move mv = back();
-    size_ -= 1;
-    return mv;
-  }
-
-  int size() { return size_; }
+struct SliderMagic {
+  u64 mask;    // relevant blockers, board edges excluded
+  u64 magic;   // multiplier mapping each blocker subset to a slot (not
+               // used when indexing with pext)
+  u64 *attacks; // start of this square's slice of the shared attack table
+  int shift;
 
-  void push_back(Move mv) {
-    data[size_] = mv;
-    size_ += 1;
-  }
-};
-
-struct LazyMovegen {
-  bool hasGenSpecial;
-  SpecialMoveBuffer sbuffer;
-
-  std::array<int, 64> srcList;
-  int srcIndex;
-  int numSrcs;
-
-  std::array<int, 64> currDests;
-  int currDestIndex;
-  int numCurrDests;
-  bool _hasNext;
-
-  bool hasNext() { return _hasNext; }
-
-  LazyMovegen(u64 srcMap, std::array<u64, 64> &attackMap) {
-    hasGenSpecial = false;
-
-    _hasNext = true;
-    bitscanAllInt(srcList, srcMap, numSrcs);
-    if (numSrcs == 0) {
-      _hasNext = false;
-    }
-    srcIndex = 0;
-    while (true) {
-      if (srcIndex == numSrcs) {
-        _hasNext = false;
-        break;
-      }
-      bitscanAllInt(currDests, attackMap[srcList[srcIndex]], numCurrDests);
-      currDestIndex = 0;
-      if (numCurrDests == 0) {
-        srcIndex += 1;
-      } else {
-        break;
-      }
-    }
-  }
-
-  void next(std::array<u64, 64> &attackMap, int &srcout, int &destout) {
-    if (!hasNext()) {
-      throw;
-    }
-    srcout = srcList[srcIndex];
-    destout = currDests[currDestIndex];
-    currDestIndex += 1;
-    if (currDestIndex == numCurrDests) {
-      srcIndex += 1;
-      if (srcIndex == numSrcs) {
-        _hasNext = false;
-      } else {
-        // load new
-        while (true) {
-          if (srcIndex == numSrcs) {
-            _hasNext = false;
-            break;
-          }
-          bitscanAllInt(currDests, attackMap[srcList[srcIndex]], numCurrDests);
-          currDestIndex = 0;
-          if (numCurrDests == 0) {
-            srcIndex += 1;
-          } else {
-            break;
-          }
-        }
-      }
-    }
+  unsigned index(u64 occupants) {
+    return ((occupants & mask) * magic) >> shift;
   }
 };
 
+// boardState as it was before mv, packed into 16 bytes
 struct BoardStateNode {
-  int data[BOARD_STATE_ENTROPY];
   u64 hash;
   Move mv;
+  uint16_t halfmove;
+  int8_t epSquare;
+  uint8_t flags; // turn, castling rights (4 bits), has repeated
+  uint8_t lastMoved;
+  uint8_t lastCaptured;
+
+  void pack(int *data, Move mv0, u64 hash0) {
+    hash = hash0;
+    mv = mv0;
+    halfmove = data[HALFMOVE_INDEX];
+    epSquare = data[EN_PASSANT_INDEX];
+    flags = data[TURN_INDEX] | (data[W_LONG_INDEX] << 1) |
+            (data[W_SHORT_INDEX] << 2) | (data[B_LONG_INDEX] << 3) |
+            (data[B_SHORT_INDEX] << 4) | (data[HAS_REPEATED_INDEX] << 5);
+    lastMoved = data[LAST_MOVED_INDEX];
+    lastCaptured = data[LAST_CAPTURED_INDEX];
+  }
+
+  void unpack(int *data) {
+    data[TURN_INDEX] = flags & 1;
+    data[EN_PASSANT_INDEX] = epSquare;
+    data[W_LONG_INDEX] = (flags >> 1) & 1;
+    data[W_SHORT_INDEX] = (flags >> 2) & 1;
+    data[B_LONG_INDEX] = (flags >> 3) & 1;
+    data[B_SHORT_INDEX] = (flags >> 4) & 1;
+    data[LAST_MOVED_INDEX] = lastMoved;
+    data[LAST_CAPTURED_INDEX] = lastCaptured;
+    data[HAS_REPEATED_INDEX] = (flags >> 5) & 1;
+    data[HALFMOVE_INDEX] = halfmove;
+  }
 };
 
 struct CounterMoveTable {
@@ -143,6 +87,7 @@ struct CounterMoveTable {
     for (int i = 0; i < 64; i++) {
       for (int k = 0; k < 64; k++) {
         arr[White][i][k] = Move();
+        arr[Black][i][k] = Move();
       }
     }
   }
@@ -151,6 +96,10 @@ struct CounterMoveTable {
     return arr[side][prev.getSrcIndex()][prev.getDestIndex()] == mv;
   }
 
+  Move get(Color side, Move prev) {
+    return arr[side][prev.getSrcIndex()][prev.getDestIndex()];
+  }
+
   void insert(Color side, Move prev, Move counter) {
     arr[side][prev.getSrcIndex()][prev.getDestIndex()] = counter;
   }
@@ -206,23 +155,22 @@ struct KillerTable {
   }
 };
 
-struct PseudoLegalData {
-  std::array<u64, 64> aMap;
-  std::array<u64, 64> dMap;
-
-  PseudoLegalData(std::array<u64, 64> a, std::array<u64, 64> d) {
-    aMap = a;
-    dMap = d;
-  }
-};
+const int MAX_GAME_PLIES = 2048; // game moves plus search plies
+// room kept free for the search, so a game may have at most
+// MAX_GAME_PLIES - MAX_SEARCH_PLIES plies (position refuses longer ones)
+const int MAX_SEARCH_PLIES = 128;
 
-class BoardStateStack {
+class BoardStateStack { // ply-indexed, never reallocates
 private:
   size_t _index;
-  std::vector<BoardStateNode> _data;
+  std::array<BoardStateNode, MAX_GAME_PLIES> _data;
+  // node hashes again, packed densely so repetition scans stay in cache
+  std::array<u64, MAX_GAME_PLIES> _keys;
+  // for each ply, the first key a position there can still repeat
+  std::array<uint16_t, MAX_GAME_PLIES + 1> _reversibleFrom;
 
 public:
-  BoardStateStack() { _index = 0; }
+  BoardStateStack() { clear(); }
 
   Move peekAt(int index) { return _data[index].mv; }
 
@@ -230,36 +178,49 @@ public:
 
   void clear() {
     _index = 0;
-    _data.clear();
+    _reversibleFrom[0] = 0;
   }
 
   BoardStateNode &peek() {
     if (_index == 0) {
       debugLog("pop from empty move stack");
-      throw;
+      throw std::out_of_range("peek at empty state stack");
     }
-    return _data.back();
+    return _data[_index - 1];
   }
 
   void push(int *data, Move mv, u64 hash) {
-    BoardStateNode node;
-    for (size_t i = 0; i < BOARD_STATE_ENTROPY; i++) {
-      node.data[i] = data[i];
+    if (_index == MAX_GAME_PLIES) {
+      debugLog("push to full state stack");
+      throw std::length_error("state stack full");
     }
-    node.mv = mv;
-    node.hash = hash;
-    _data.push_back(node);
+    _data[_index].pack(data, mv, hash);
+    _keys[_index] = hash;
+    _reversibleFrom[_index + 1] = _reversibleFrom[_index];
     _index++;
   };
 
+  // the last pushed move can't be undone, so nothing before it can repeat
+  void markIrreversible() { _reversibleFrom[_index] = _index; }
+
+  // earlier positions with the same side to move and the given key
+  int repetitions(u64 key) {
+    int count = 0;
+    for (int i = (int)_index - 2; i >= _reversibleFrom[_index]; i -= 2) {
+      if (_keys[i] == key) {
+        count++;
+      }
+    }
+    return count;
+  }
+
   bool canPop() { return _index > 0; }
 
   void pop() {
     if (_index == 0) {
       debugLog("pop from empty state stack");
-      throw;
+      throw std::out_of_range("pop from empty state stack");
     }
-    _data.pop_back();
     _index--;
   }
 
@@ -283,6 +244,16 @@ struct PerftCounter {
     checks = 0;
     checkmates = 0;
   }
+
+  void add(const PerftCounter &other) {
+    nodes += other.nodes;
+    captures += other.captures;
+    ep += other.ep;
+    castles += other.castles;
+    promotions += other.promotions;
+    checks += other.checks;
+    checkmates += other.checkmates;
+  }
 };
 
 template <int N> struct MoveVector {
@@ -299,7 +270,7 @@ template <int N> struct MoveVector {
     if (size_ > 0) {
       size_--;
     } else {
-      throw;
+      throw std::out_of_range("pop from empty move vector");
     }
   }
 
@@ -307,7 +278,7 @@ template <int N> struct MoveVector {
     if (size_ > 0) {
       return data[size_ - 1];
     } else {
-      throw;
+      throw std::out_of_range("back of empty move vector");
     }
   }
 
@@ -6,16 +6,50 @@
 #include <unordered_set>
 
 void populateMoveCache();
-void initializeZobrist();
 u64 kingMoves(int i);
 u64 rookMoves(int i, int d);
+u64 rookAttacks(int i, u64 occupants);
+u64 bishopAttacks(int i, u64 occupants);
+std::string sliderBackend();
 u64 getBackRank(Color c);
 
+// Copy-make counterpart of Board: the position itself and nothing derived
+// from it, in about 200 bytes of plain data. doMove writes the result into a
+// separate child, so a search keeps one per ply and nothing has to be undone,
+// and another thread can simply be handed a copy.
+struct Position {
+  u64 bitboard[12];
+  u64 colorOccupancy[2];
+  u64 key; // same zobrist key a Board in this position has
+  int8_t mailbox[64];
+  int8_t turn;
+  int8_t epIndex;   // square a pawn may capture onto, -1 if none
+  uint8_t castling; // bit per right, in boardState order from W_LONG_INDEX
+  uint16_t halfmove;
+
+  u64 occupancy() const {
+    return colorOccupancy[White] | colorOccupancy[Black];
+  }
+  bool isAttacked(int index, Color byWho) const;
+  bool isCheck() const;
+
+  // pseudo-legal moves, doMove turns down the ones that leave the king
+  // attacked; castles are only generated when the king's path is safe
+  void generate(MoveVector<256> &moves) const;
+  bool doMove(Move mv, Position &child) const; // false if mv is illegal
+
+private:
+  void _addPiece(PieceType p, int index);
+  void _removePiece(PieceType p, int index);
+};
+
 class Board {
 private:
   BoardStatus _status;
 
-  std::vector<PseudoLegalData> _pseudoStack;
+  u64 _changedSquares; // squares touched by _addPiece/_removePiece this move
+  u64 _colorOccupancy[2]; // kept in step with bitboard by _addPiece/_removePiece
+  u64 _occupied;
 
   // incremental update zobrist methods
   void _removePiece(PieceType p, u64 location);
@@ -25,7 +59,21 @@ private:
   void _switchTurn();
   void _switchTurn(Color t);
 
-  bool _isInLineWithKing(u64 square, Color kingColor, u64 kingBB);
+  // per-position legality data, computed on first use after the position
+  // changes
+  bool _hasLegalityInfo;
+  u64 _checkers;
+  u64 _pinned;
+  u64 _pinRay[64]; // only valid for squares in _pinned
+  void _computeLegalityInfo();
+
+  // per-position check data for the side to move, computed on first use
+  bool _hasCheckInfo;
+  u64 _checkSquares[6]; // by piece kind, squares that attack the enemy king
+  u64 _discoverers;
+  u64 _discoverRay[64]; // only valid for squares in _discoverers
+  void _computeCheckInfo();
+
   bool _isInLineWithKing(u64 square, Color kingColor, u64 kingBB, u64 &outPinner);
 
   u64 _zobristHash;
@@ -33,12 +81,16 @@ private:
   u64 _isUnderAttack(u64 target); // return a set that attack the target
   u64 _isUnderAttack(
       u64 target, Color byWho); // return a set of pieces that attack the target
+  u64 _attackersTo(int index, u64 occupants);
+  u64 _xrayAttackersTo(int index, u64 occupants, PieceType vacated);
   PieceType
   _leastValuablePiece(u64 sqset, Color color,
                       u64 &outposition); // returns the least valuable piece of
                                          // color color in sqset
 
   void _generatePseudoLegal();
+  void _updatePseudoLegal(u64 changed);
+  u64 _attacksFrom(int index, u64 occupants);
 
   u64 _bishopAttacks(u64 index64, u64 occupants);
   u64 _rookAttacks(u64 index64, u64 occupants);
@@ -50,15 +102,33 @@ private:
   u64 _rookRay(u64 origin, int direction, u64 mask);
   u64 _bishopRay(u64 origin, int direction, u64 mask);
 
-  bool _verifyLegal(Move mv);
+  // specialized on the side to move C, the public wrappers dispatch on turn()
+  template <Color C> bool _verifyLegal(Move mv);
+  template <Color C> bool _canCastle(bool isLong);
+  template <Color C> void _generateCaptures(MoveVector<256> &moves, u64 from);
+  template <Color C> void _generateQuiets(MoveVector<256> &moves, u64 from);
+  template <Color C> void _generateEvasions(MoveVector<256> &moves);
+  template <Color C> bool _hasLegalMove();
+  template <Color C> void _makeMove(Move mv);
+  template <Color C> void _unmakeMove(); // C made the move being taken back
 
 public:
   BoardStateStack stack;
   u64 bitboard[12];
+  PieceType mailbox[64]; // piece on each square, Empty if none
+
+  // if set, makeMove passes it the new key before updating the attack maps,
+  // so a table can start loading the child's entry early. Null on a new
+  // board, the search sets it on the boards it searches.
+  void (*prefetch)(u64 key);
 
   int fullmoveOffset;
 
-  void perft(int depth, PerftCounter& pcounter);
+  u64 perft(int depth); // leaf node count
+  void perft(int depth, PerftCounter& pcounter); // detailed breakdown
+  void perftMove(Move mv, int depth, PerftCounter &pcounter); // one subtree
+
+  Position position(); // copy of the current position for copy-make
 
   float pieceScoreEarlyGame[12];
   float pieceScoreLateGame[12];
@@ -67,21 +137,28 @@ public:
   std::array<u64, 64> defendMap;
 
 
-  void generateSpecialMoves(SpecialMoveBuffer &sbuffer);
-  Move nextMove(LazyMovegen &movegen);
 
   u64 rookStartingPositions[2][2];
   u64 kingStartingPositions[2];
 
   int boardState[BOARD_STATE_ENTROPY];
-  u64 occupancy();
-  u64 occupancy(Color color); // COSTLY????
+  u64 occupancy() { return _occupied; }
+  u64 occupancy(Color color) { return _colorOccupancy[color]; }
 
   int see(Move mv);
+  bool seeGE(Move mv, int threshold); // see(mv) >= threshold, early exit
 
   // shortcut move gen
   MoveVector<256> produceUncheckMoves();
 
+  // typed move gen, appends legal moves to the caller's vector
+  // captures and quiets assume the side to move is not in check
+  void generateCaptures(MoveVector<256> &moves); // incl. ep and promotions
+  void generateQuiets(MoveVector<256> &moves);   // incl. castles
+  void generateEvasions(MoveVector<256> &moves);
+  void generateQuietChecks(MoveVector<256> &moves);
+  bool isLegalMove(Move mv);
+
   bool isCheckingMove(Move mv);
   
   // Important stuff
@@ -89,14 +166,15 @@ public:
   Color turn();
   u64 zobrist();
   bool isCheck();
+  bool hasLegalMove(); // stops at the first piece that has one
   Move lastMove();
 
-  // costly calls
   PieceType pieceAt(u64 space);
   PieceType pieceAt(u64 space, Color color);
 
   std::string fen();
-  BoardStatus status();
+  BoardStatus status(); // may generate moves to tell mate from stalemate
+  bool isDrawByRule();  // repetition, fifty moves or insufficient material
 
   // eval features
   float kingSafety(Color c);
@@ -69,11 +69,6 @@ std::string squareName(int square);
 
 int indexFromSquareName(std::string alg);
 
-u64 u64FromPair(int r, int c);
-int intFromPair(int r, int c);
-
-int distToClosestCorner(int r, int c);
-
 // LSB (rightmost, uppermost)
 inline int bitscanForward(u64 x) { // checked, should work
   return __builtin_ffsll(x) - 1;
@@ -82,7 +77,7 @@ inline int bitscanForward(u64 x) { // checked, should work
 // MSB (leftmost, uppermost)
 inline int bitscanReverse(u64 x) { return 63 - __builtin_clzll(x); }
 
-inline u64 u64FromIndex(int i) { // fixed, should work
+constexpr u64 u64FromIndex(int i) { // fixed, should work
   return (1UL) << i;
 }
 
@@ -92,7 +87,7 @@ void dump64(u64 x);
 
 int hadd(u64 x);
 
-inline int max(int i1, int i2) {
+constexpr int max(int i1, int i2) {
   if (i1 > i2) {
     return i1;
   } else {
@@ -100,7 +95,7 @@ inline int max(int i1, int i2) {
   }
 }
 
-inline int min(int i1, int i2) {
+constexpr int min(int i1, int i2) {
   if (i1 < i2) {
     return i1;
   } else {
@@ -116,7 +111,12 @@ void srand100(int seed);
 
 std::vector<std::string> tokenize(std::string instring);
 
-inline bool inBounds(int y, int x) {
+// The position of an epd line as a full fen, empty for blank and comment
+// lines. Move counters that aren't there, as when operations follow the
+// fourth field, get their defaults.
+std::string epdFen(const std::string &line);
+
+constexpr bool inBounds(int y, int x) {
   return (y >= 0 && y < 8) && (x >= 0 && x < 8);
 }
 
@@ -124,11 +124,16 @@ inline int u64ToRow(u64 space) { return bitscanForward(space) / 8; }
 
 inline int u64ToCol(u64 space) { return bitscanForward(space) % 8; }
 
-inline int intToRow(int s) { return s / 8; }
-inline int intToCol(int s) { return s % 8; }
+constexpr int intToRow(int s) { return s / 8; }
+constexpr int intToCol(int s) { return s % 8; }
 
-inline u64 u64FromPair(int r, int c) { return u64FromIndex(r * 8 + c); }
+constexpr u64 u64FromPair(int r, int c) { return u64FromIndex(r * 8 + c); }
 
-inline int intFromPair(int r, int c) { return r * 8 + c; }
+constexpr int intFromPair(int r, int c) { return r * 8 + c; }
+
+// manhattan distance to the nearest corner
+constexpr int distToClosestCorner(int r, int c) {
+  return min(r, 7 - r) + min(c, 7 - c);
+}
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef PERFT_HPP
+#define PERFT_HPP
+#include <atomic>
+#include <game/board.hpp>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace Perft {
+
+// Node counts of (position, remaining depth) pairs. Shared by the perft
+// workers without locking: each entry stores key ^ nodes next to nodes, so a
+// torn write fails the key check instead of returning a wrong count.
+class HashTable {
+  struct Entry {
+    std::atomic<u64> check;
+    std::atomic<u64> nodes;
+  };
+  std::unique_ptr<Entry[]> _entries;
+  u64 _mask;
+
+public:
+  HashTable() : _mask(0) {}
+
+  void resize(int megabytes); // rounded down to a power of two, 0 disables
+  void clear();
+  bool enabled() { return _entries != nullptr; }
+  int megabytes();
+
+  bool probe(u64 key, u64 &outNodes);
+  void save(u64 key, u64 nodes);
+};
+
+u64 key(Board &board, int depth);
+
+// bulk counting perft on copy-made Positions, one slot per ply, for
+// comparing against make/unmake on Board
+u64 copyMake(const Position &root, int depth);
+
+// bulk counting perft with its subtrees looked up in and saved to table
+u64 hashed(Board &board, int depth, HashTable &table);
+
+struct RootResult {
+  Move mv;
+  PerftCounter counter;
+
+  RootResult(Move m) : mv(m) {}
+};
+
+// Splits the root moves of board over threads, each working on its own copy
+// of the board. Results come back in root move order. The table, if given and
+// enabled, is only used for plain node counts.
+std::vector<RootResult> divide(Board &board, int depth, int threads,
+                               bool detailed, HashTable *table = nullptr);
+
+PerftCounter total(const std::vector<RootResult> &results);
+
+// Runs every "<fen> ;D<depth> <nodes> ..." line of an EPD file, skipping
+// depths above maxDepth (0 for all). Reports each check to out and returns
+// false if any count is off or the file can't be read.
+bool suite(const std::string &path, int threads, int maxDepth,
+           HashTable *table, std::ostream &out);
+
+// Walks depth plies below every position of an EPD file and checks that
+// isCheckingMove agrees with making the move and testing for check. Reports
+// each disagreement to out and returns false if there was any.
+bool checkSuite(const std::string &path, int depth, std::ostream &out);
+
+} // namespace Perft
+
+#endif
@@ -1,7 +1,95 @@
+#include <map>
 #include <time.h>
 
 #include <chess20.hpp>
 #include <game/ai.hpp>
+#include <game/perft.hpp>
+
+// perftsuite <file> [threads <n>] [depth <max>] [hash <mb>]
+bool perftSuiteCommand(const std::vector<std::string> &tokens,
+                       Perft::HashTable &table) {
+  if (tokens.size() < 2) {
+    std::cout << "usage: perftsuite <file> [threads <n>] [depth <max>] "
+                 "[hash <mb>]\n";
+    return false;
+  }
+  int threads = max(1, std::thread::hardware_concurrency());
+  int maxDepth = 0;
+  for (int k = 2; k + 1 < (int)tokens.size(); k += 2) {
+    if (tokens[k] == "threads") {
+      threads = std::stoi(tokens[k + 1]);
+    } else if (tokens[k] == "depth") {
+      maxDepth = std::stoi(tokens[k + 1]);
+    } else if (tokens[k] == "hash") {
+      table.resize(std::stoi(tokens[k + 1]));
+    }
+  }
+  return Perft::suite(tokens[1], threads, maxDepth, &table, std::cout);
+}
+
+// checksuite <file> [depth <n>]
+bool checkSuiteCommand(const std::vector<std::string> &tokens,
+                       Perft::HashTable &) {
+  if (tokens.size() < 2) {
+    std::cout << "usage: checksuite <file> [depth <n>]\n";
+    return false;
+  }
+  int depth = 3;
+  for (int k = 2; k + 1 < (int)tokens.size(); k += 2) {
+    if (tokens[k] == "depth") {
+      depth = std::stoi(tokens[k + 1]);
+    }
+  }
+  return Perft::checkSuite(tokens[1], depth, std::cout);
+}
+
+// ttstress [threads <n>] [ms <millis>]
+bool tableStressCommand(const std::vector<std::string> &tokens,
+                        Perft::HashTable &) {
+  int threads = max(4, std::thread::hardware_concurrency());
+  int millis = 2000;
+  for (int k = 1; k + 1 < (int)tokens.size(); k += 2) {
+    if (tokens[k] == "threads") {
+      threads = std::stoi(tokens[k + 1]);
+    } else if (tokens[k] == "ms") {
+      millis = std::stoi(tokens[k + 1]);
+    }
+  }
+  return AI::tableStress(threads, millis, std::cout);
+}
+
+// stalemates <file> [depth <n>]
+bool stalemateSuiteCommand(const std::vector<std::string> &tokens,
+                           Perft::HashTable &) {
+  if (tokens.size() < 2) {
+    std::cout << "usage: stalemates <file> [depth <n>]\n";
+    return false;
+  }
+  int depth = 4;
+  for (int k = 2; k + 1 < (int)tokens.size(); k += 2) {
+    if (tokens[k] == "depth") {
+      depth = std::stoi(tokens[k + 1]);
+    }
+  }
+  return AI::stalemateSuite(tokens[1], depth, std::cout);
+}
+
+// Self-check commands. Each runs as a UCI command and from the command
+// line as chess20 <name> ..., where the exit code tells if it passed. The
+// table is the perft hash table, which the UCI PerftHash option sizes.
+typedef bool (*SelfCheck)(const std::vector<std::string> &tokens,
+                          Perft::HashTable &table);
+
+SelfCheck findSelfCheck(const std::string &name) {
+  static const std::map<std::string, SelfCheck> SELF_CHECKS = {
+      {"perftsuite", perftSuiteCommand},
+      {"checksuite", checkSuiteCommand},
+      {"ttstress", tableStressCommand},
+      {"stalemates", stalemateSuiteCommand},
+  };
+  auto found = SELF_CHECKS.find(name);
+  return found == SELF_CHECKS.end() ? nullptr : found->second;
+}
 
 class UCIInterface {
 private:
@@ -12,6 +100,7 @@ public:
   std::atomic<bool> _stopKiller{false};
   Move bestMove;
   Board board;
+  Perft::HashTable perftTable;
   std::thread _task;
 
   std::thread _stopperTask;
@@ -21,14 +110,46 @@ public:
     _stopKiller = false;
   }
 
+  void helperThink(int index, Board helperBoard,
+                   std::chrono::_V2::system_clock::time_point start) {
+    // Lazy SMP helper: iterative deepening on its own board until the main
+    // thread stops. Helpers alternate which depths they skip, so half of
+    // them run a ply ahead and fill the shared table for the main thread.
+    AI::bindThread(index);
+    u64 nodeCount = 0;
+    Move helperMove = Move::NullMove();
+    Score helperScore = SCORE_MIN;
+    std::vector<MoveScore> prevScores;
+    for (int depth = 0; depth < MAX_SEARCH_DEPTH && !_notThinking; depth++) {
+      if (depth > 2 && (depth + index) % 2 == 0) {
+        continue;
+      }
+      helperMove =
+          AI::rootSearch(helperBoard, depth, helperScore, _notThinking,
+                         helperScore, helperMove, nodeCount, start, prevScores);
+      if (AI::isCheckmateScore(helperScore)) {
+        break; // deeper won't find anything better than a mate
+      }
+    }
+  }
+
   void think() {
     auto start = std::chrono::high_resolution_clock::now();
     // sendCommand("info string think() routine started");
+    AI::newSearch();
+    AI::bindThread(0);
+    board.prefetch = AI::prefetch; // helpers get it with their copy
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < AI::threadCount(); i++) {
+      // board is copied here, before the main thread starts moving on it
+      helpers.push_back(
+          std::thread(&UCIInterface::helperThink, this, i, board, start));
+    }
     // iterative deepening
 
     int depth = 0;
-    int nodeCount = 1;
-    int depthLimit = SCORE_MAX;
+    u64 nodeCount = 1;
+    int depthLimit = MAX_SEARCH_DEPTH;
     Score bestScore(SCORE_MIN);
     bestMove = Move::NullMove();
     std::vector<MoveScore> prevScores;
@@ -36,8 +157,9 @@ public:
     for (depth = 0; depth < depthLimit; depth++) {
       Score score;
       // send principal variation move from previous
-      Move calcMove = AI::rootMove(board, depth, _notThinking, score, bestMove,
-                                   nodeCount, start, prevScores);
+      Move calcMove = AI::rootSearch(board, depth, bestScore, _notThinking,
+                                     score, bestMove, nodeCount, start,
+                                     prevScores);
       if (_notThinking) {
         debugLog("search interrupted");
         if (depth <= 1) {
@@ -63,9 +185,13 @@ public:
         bestScore = score;
       }
     }
+    _notThinking = true; // helpers stop with the main thread
+    for (auto &helper : helpers) {
+      helper.join();
+    }
+    board.prefetch = nullptr; // perft on this board shouldn't touch the table
     sendCommand("bestmove " + bestMove.moveToUCIAlgebraic());
     _stopKiller = true;
-    _notThinking = true;
   }
 
   void stopThinking() {
@@ -124,6 +250,9 @@ public:
       sendCommand("id name Jchess 0.1");
       sendCommand("id author Jerome Wei");
       sendCommand("option name Foo type check default false");
+      sendCommand("option name PerftHash type spin default 0 min 0 max 4096");
+      sendCommand("option name Hash type spin default 64 min 1 max 65536");
+      sendCommand("option name Threads type spin default 1 min 1 max 256");
       sendCommand("uciok");
     } else if (tokens[0] == "debug") {
       if (tokens[1] == "on") {
@@ -134,6 +263,28 @@ public:
     } else if (tokens[0] == "isready") {
       sendCommand("readyok");
     } else if (tokens[0] == "setoption") {
+      // setoption name <id> value <x>
+      std::string name;
+      std::string value;
+      bool isValue = false;
+      for (int k = 2; k < (int)tokens.size(); k++) {
+        if (tokens[k] == "value") {
+          isValue = true;
+        } else if (isValue) {
+          value += value.empty() ? tokens[k] : " " + tokens[k];
+        } else {
+          name += name.empty() ? tokens[k] : " " + tokens[k];
+        }
+      }
+      if (name == "PerftHash" && !value.empty()) {
+        perftTable.resize(std::stoi(value));
+      } else if (name == "Hash" && !value.empty()) {
+        stopThinking();
+        AI::setHashSize(min(65536, std::stoi(value)));
+      } else if (name == "Threads" && !value.empty()) {
+        stopThinking();
+        AI::setThreads(min(256, std::stoi(value)));
+      }
 
     } else if (tokens[0] == "register") {
       /*
@@ -180,8 +331,16 @@ operation.*/
       }
       if ((int)tokens.size() > j) {
         if (tokens[j] == "moves") {
-          // play moves
+          // play moves, leaving the search its room on the state stack
           for (int k = j + 1; k < (int)tokens.size(); k++) {
+            if ((int)board.stack.getIndex() >=
+                MAX_GAME_PLIES - MAX_SEARCH_PLIES) {
+              sendCommand("info string error: games longer than " +
+                          std::to_string(MAX_GAME_PLIES - MAX_SEARCH_PLIES) +
+                          " plies are not supported, ignoring the remaining "
+                          "moves");
+              break;
+            }
             auto mvtxt = tokens[k];
             Move mv = board.moveFromAlgebraic(mvtxt);
             board.makeMove(mv);
@@ -297,27 +456,93 @@ operation.*/
          * quit
               quit the program as soon as possible
       */
+      stopThinking(); // the search must not outlive the tables
       exit(0);
     } else if (tokens[0] == "dump") {
       board.dump(true);
     } else if (tokens[0] == "perft") {
-      PerftCounter pcounter;
-      int depth = std::stoi(tokens[1]);
+      // perft [divide] <depth> [detailed] [threads <n>] [hash <mb>]
+      // perft <depth> copymake
+      int depth = 1;
+      bool detailed = false;
+      bool divide = false;
+      bool copymake = false;
+      int threads = max(1, std::thread::hardware_concurrency());
+      for (int k = 1; k < (int)tokens.size(); k++) {
+        if (tokens[k] == "detailed") {
+          detailed = true;
+        } else if (tokens[k] == "divide") {
+          divide = true;
+        } else if (tokens[k] == "copymake") {
+          copymake = true;
+        } else if (tokens[k] == "threads" && k + 1 < (int)tokens.size()) {
+          k++;
+          threads = std::stoi(tokens[k]);
+        } else if (tokens[k] == "hash" && k + 1 < (int)tokens.size()) {
+          k++;
+          perftTable.resize(std::stoi(tokens[k]));
+        } else {
+          depth = std::stoi(tokens[k]);
+        }
+      }
+      if (copymake) {
+        // one thread and plain counts, to time against the lines below
+        auto start = std::chrono::high_resolution_clock::now();
+        u64 nodes = Perft::copyMake(board.position(), depth);
+        auto stop = std::chrono::high_resolution_clock::now();
+        int time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       stop - start)
+                       .count();
+        std::cout << "Nodes: " << nodes << "\n";
+        std::cout << "Time: " << time << " ms";
+        std::cout << "\nMnps: "
+                  << (double)nodes / ((double)max(time, 1) * 1000.0) << "\n";
+        return;
+      }
       std::cout << "Zob before: ";
       u64 before = board.zobrist();
       dump64(before);
-      board.perft(depth, pcounter);
+      auto start = std::chrono::high_resolution_clock::now();
+      perftTable.clear(); // counts from another run would be free nodes
+      auto results =
+          Perft::divide(board, depth, threads, detailed, &perftTable);
+      auto stop = std::chrono::high_resolution_clock::now();
+      int time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     stop - start)
+                     .count();
+      if (divide) {
+        for (const auto &result : results) {
+          Move mv = result.mv;
+          std::cout << mv.moveToUCIAlgebraic() << ": " << result.counter.nodes
+                    << "\n";
+        }
+        std::cout << "Moves: " << results.size() << "\n";
+      }
+      PerftCounter pcounter = Perft::total(results);
       std::cout << "Nodes: " << pcounter.nodes << "\n";
-      std::cout << "Captures: " << pcounter.captures << "\n";
-      std::cout << "Castles: " << pcounter.castles << "\n";
-      std::cout << "EP: " << pcounter.checks << "\n";
-      std::cout << "EP: " << pcounter.ep << "\n";
-      std::cout << "Promotions: " << pcounter.promotions << "\n";
-      std::cout << "Checkmates: " << pcounter.checkmates;
+      if (detailed) {
+        std::cout << "Captures: " << pcounter.captures << "\n";
+        std::cout << "Castles: " << pcounter.castles << "\n";
+        std::cout << "EP: " << pcounter.checks << "\n";
+        std::cout << "EP: " << pcounter.ep << "\n";
+        std::cout << "Promotions: " << pcounter.promotions << "\n";
+        std::cout << "Checkmates: " << pcounter.checkmates << "\n";
+      }
+      std::cout << "Threads: " << threads << "\n";
+      if (perftTable.enabled() && !detailed) {
+        std::cout << "Hash: " << perftTable.megabytes() << " MB\n";
+      }
+      std::cout << "Time: " << time << " ms";
+      std::cout << "\nNPS: "
+                << (u64)((double)pcounter.nodes / ((double)max(time, 1) / 1000.0));
+      std::cout << "\nMnps: "
+                << (double)pcounter.nodes / ((double)max(time, 1) * 1000.0);
       std::cout << "\nZob after: ";
       u64 after = board.zobrist();
       dump64(after);
       std::cout << "Are they the same?" << yesorno((before == after)) << "\n";
+    } else if (findSelfCheck(tokens[0]) != nullptr) {
+      findSelfCheck(tokens[0])(tokens, perftTable);
     } else if (tokens[0] == "unmake") {
       if (board.canUndo()) {
         board.unmakeMove();
@@ -328,14 +553,21 @@ operation.*/
   ~UCIInterface() { stopThinking(); }
 };
 
-int main() {
+int main(int argc, char **argv) {
   populateMoveCache();
-  initializeZobrist();
   AI::init();
   // srand100(65634536);
   srand100(13194);
 
-  sendCommand("info string initialized");
+  if (argc > 1 && findSelfCheck(argv[1]) != nullptr) {
+    // run from the command line, the exit code tells if it passed
+    std::vector<std::string> tokens(argv + 1, argv + argc);
+    Perft::HashTable table;
+    return findSelfCheck(argv[1])(tokens, table) ? 0 : 1;
+  }
+
+  sendCommand("info string initialized, " + sliderBackend() +
+              " slider attacks");
   {
     UCIInterface interface;
     for (std::string command; std::getline(std::cin, command);) {
@@ -345,7 +577,12 @@ int main() {
         b.loadPosition(command.substr(7, command.size()));
         std::cout << b.vectorize();
       } // vectorize a FEN tool
-      interface.recieveCommand(command);
+      try {
+        interface.recieveCommand(command);
+      } catch (const std::exception &e) {
+        // report and carry on with the next command instead of aborting
+        sendCommand(std::string("info string error: ") + e.what());
+      }
     }
   }
 
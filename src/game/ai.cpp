@@ -1,27 +1,225 @@
+#include <fstream>
 #include <game/ai.hpp>
+#include <memory>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+TranspositionTable table;
+MiniTable pvTable;
+std::vector<std::unique_ptr<SearchThread>> searchThreads;
+thread_local SearchThread *thisThread = nullptr;
+
+const u64 HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+void TranspositionTable::resize(u64 bytes) {
+  // the old table stays until the new one is allocated, so a failure
+  // leaves it in place
+  u64 count = 1;
+  while (count * 2 * sizeof(TableCluster) <= bytes) {
+    count *= 2;
+  }
+  while (true) {
+    u64 size = count * sizeof(TableCluster);
+    // sizes are powers of two, so they are multiples of the alignment
+    u64 alignment =
+        size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : sizeof(TableCluster);
+    TableCluster *mem = (TableCluster *)std::aligned_alloc(alignment, size);
+    if (mem != nullptr) {
+#ifdef MADV_HUGEPAGE
+      if (alignment == HUGE_PAGE_SIZE) {
+        madvise(mem, size, MADV_HUGEPAGE); // only advice, fine if ignored
+      }
+#endif
+      _arr.reset(mem);
+      _mask = count - 1;
+      break;
+    }
+    if (count == 1) {
+      debugLog("hash table allocation failed, keeping the old table");
+      throw std::bad_alloc();
+    }
+    debugLog("hash table allocation of " + std::to_string(size) +
+             " bytes failed, halving");
+    count /= 2;
+  }
+  clear();
+}
+
+void TranspositionTable::clear() {
+  for (u64 i = 0; i <= _mask; i++) {
+    for (TableEntry &entry : _arr.get()[i].entries) {
+      entry.check.store(0, std::memory_order_relaxed);
+      entry.data.store(0, std::memory_order_relaxed);
+    }
+  }
+  _generation = 0;
+}
 
-TranspositionTable<4194304> table;
-MiniTable<131072> pvTable;
-KillerTable kTable;
-HistoryTable hTable;
-CounterMoveTable cTable;
+int TranspositionTable::megabytes() {
+  return (int)(((_mask + 1) * sizeof(TableCluster)) / (1024 * 1024));
+}
+
+void AI::prefetch(u64 key) { table.prefetch(key); }
 
 void AI::init() {
-  //...
+  setHashSize(64);
+  setThreads(1);
+  bindThread(0);
 }
 
-Move popMin(std::vector<MoveScore> &vec) {
-  int m = SCORE_MAX;
-  int minI = 0;
-  for (int i = 0; i < (int)vec.size(); i++) {
-    if (vec[i].score < m) {
-      m = vec[i].score;
-      minI = i;
+void AI::setHashSize(int megabytes) {
+  table.resize((u64)max(1, megabytes) * 1024 * 1024);
+  u64 clusters = (u64)table.megabytes() * 1024 * 1024 / sizeof(TableCluster);
+  pvTable.resize(clusters / 64 > 1024 ? clusters / 64 : 1024);
+}
+
+int AI::hashSize() { return table.megabytes(); }
+
+void AI::setThreads(int n) {
+  n = max(1, n);
+  while ((int)searchThreads.size() > n) {
+    searchThreads.pop_back();
+  }
+  while ((int)searchThreads.size() < n) {
+    searchThreads.emplace_back(new SearchThread(searchThreads.empty()));
+  }
+}
+
+int AI::threadCount() { return searchThreads.size(); }
+
+void AI::bindThread(int index) {
+  thisThread = searchThreads[index].get();
+  thisThread->nodes = 0;
+}
+
+u64 AI::totalNodes() {
+  u64 total = 0;
+  for (auto &thread : searchThreads) {
+    total += thread->nodes;
+  }
+  return total;
+}
+
+// contents the stress test stores under key, so any probe can be checked
+TableNode stressNode(u64 key) {
+  TableNode node;
+  node.hash = key;
+  node.depth = (key >> 40) & 63;
+  node.nodeType = key % 3;
+  node.bestMove.data = ((key >> 20) & 0xFFFF) | 1;
+  return node;
+}
+
+Score stressScore(u64 key) { return (Score)((key >> 7) % 200001) - 100000; }
+
+bool AI::tableStress(int threads, int millis, std::ostream &out) {
+  // few entries and four times as many keys, so threads keep writing the
+  // same entries with different positions
+  const int SLOTS = 1024;
+  TranspositionTable small;
+  small.resize(SLOTS * sizeof(TableEntry));
+  std::atomic<bool> stop{false};
+  std::atomic<u64> probes{0};
+  std::atomic<u64> hits{0};
+  std::atomic<u64> torn{0};
+
+  auto hammer = [&](u64 seed) {
+    u64 x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    u64 myProbes = 0, myHits = 0, myTorn = 0;
+    while (!stop) {
+      x ^= x << 13; // xorshift
+      x ^= x >> 7;
+      x ^= x << 17;
+      u64 key = ((x >> 8) % (4 * SLOTS) + 1) * 0x9E3779B97F4A7C15ULL;
+      TableNode node = stressNode(key);
+      if (x & 1) {
+        small.insert(node, stressScore(key));
+      } else {
+        TableBucket found;
+        myProbes++;
+        if (small.find(node, found)) {
+          myHits++;
+          if (found.second != stressScore(key) ||
+              found.first.depth != node.depth ||
+              found.first.nodeType != node.nodeType ||
+              found.first.bestMove != node.bestMove) {
+            myTorn++;
+          }
+        }
+      }
     }
+    probes += myProbes;
+    hits += myHits;
+    torn += myTorn;
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(std::thread(hammer, (u64)i + 1));
   }
-  Move bm = vec[minI].mv;
-  vec.erase(vec.begin() + minI);
-  return bm;
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  stop = true;
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  out << "threads " << threads << " probes " << probes << " hits " << hits
+      << " inconsistent " << torn << "\n";
+  return torn == 0;
+}
+
+bool AI::stalemateSuite(const std::string &path, int depth, std::ostream &out) {
+  std::ifstream file(path);
+  if (!file) {
+    out << "cannot open " << path << "\n";
+    return false;
+  }
+  Board board;
+  std::atomic<bool> stop{false};
+  u64 count = 0;
+  int positions = 0;
+  int failures = 0;
+  for (std::string line; std::getline(file, line);) {
+    std::string fen = epdFen(line);
+    if (fen.empty()) {
+      continue;
+    }
+    board.loadPosition(fen);
+    auto tokens = tokenize(line);
+    Move mv;
+    for (int k = 0; k + 1 < (int)tokens.size(); k++) {
+      if (tokens[k] == "sm") {
+        mv = board.moveFromAlgebraic(tokens[k + 1].substr(
+            0, tokens[k + 1].find(';')));
+      }
+    }
+    positions++;
+    if (mv.isNull()) {
+      out << "FAIL " << fen << " has no legal sm move\n";
+      failures++;
+      continue;
+    }
+    // played rather than loaded, so the node has a last move like any
+    // other in the tree and null move pruning may be tried there
+    board.makeMove(mv);
+    reset();
+    for (int d = 1; d <= depth; d++) {
+      Score above = zeroWindowSearch(board, d, 1, 1, stop, count, Cut);
+      Score full = alphaBetaSearch(board, d, 1, SCORE_MIN, SCORE_MAX, stop,
+                                   count, PV, false);
+      if (above != 0 || full != 0) {
+        out << "FAIL " << fen << " sm " << mv.moveToUCIAlgebraic()
+            << " depth " << d << " zero window " << above << " full window "
+            << full << "\n";
+        failures++;
+        break;
+      }
+    }
+  }
+  out << "passed " << positions - failures << "/" << positions << "\n";
+  return failures == 0;
 }
 
 Move popMax(std::vector<MoveScore> &vec) {
@@ -54,22 +252,22 @@ void sortMoves(std::vector<MoveScore> &vec) {
 bool AI::isCheckmateScore(Score sc) { return SCORE_MAX - abs(sc) < 250; }
 
 void AI::reset() {
-  kTable.clear();
-  hTable.clear();
-  cTable.clear();
+  table.clear();
+  pvTable.clear();
+  for (auto &thread : searchThreads) {
+    thread->clear();
+  }
 }
 
+void AI::newSearch() { table.newSearch(); }
+
 int AI::materialEvaluation(Board &board) { return board.material(); }
 
 int AI::evaluation(Board &board) {
-  BoardStatus status = board.status();
-
-  if (status == BoardStatus::Stalemate || status == BoardStatus::Draw)
+  // mate and stalemate are left to the search, which finds them when it
+  // runs out of moves
+  if (board.isDrawByRule())
     return 0;
-  if (status == BoardStatus::WhiteWin)
-    return SCORE_MAX;
-  if (status == BoardStatus::BlackWin)
-    return SCORE_MIN;
 
   int score = 0;
 
@@ -117,8 +315,44 @@ int AI::flippedEval(Board &board) {
   }
 }
 
-Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
-                  Score &outscore, Move prevPv, int &count,
+Move AI::rootSearch(Board &board, int depth, Score prevScore,
+                    std::atomic<bool> &stop, Score &outscore, Move prevPv,
+                    u64 &count,
+                    std::chrono::_V2::system_clock::time_point start,
+                    std::vector<MoveScore> &prevScores) {
+  const int ASPIRATION_DEPTH = 4; // shallower iterations are cheap anyway
+  const int ASPIRATION_DELTA = 25;
+  const int ASPIRATION_LIMIT = 1000; // past this, open the side fully
+
+  Score alpha = SCORE_MIN;
+  Score beta = SCORE_MAX;
+  int delta = ASPIRATION_DELTA;
+  if (depth >= ASPIRATION_DEPTH && prevScore != SCORE_MIN &&
+      !isCheckmateScore(prevScore)) {
+    alpha = prevScore - delta;
+    beta = prevScore + delta;
+  }
+  while (true) {
+    Move chosen = rootMove(board, depth, alpha, beta, stop, outscore, prevPv,
+                           count, start, prevScores);
+    if (stop) {
+      return chosen;
+    }
+    if (outscore <= alpha && alpha != SCORE_MIN) {
+      alpha = delta > ASPIRATION_LIMIT ? SCORE_MIN : outscore - delta;
+    } else if (outscore >= beta && beta != SCORE_MAX) {
+      beta = delta > ASPIRATION_LIMIT ? SCORE_MAX : outscore + delta;
+      prevPv = chosen; // the move that failed high goes first
+    } else {
+      return chosen;
+    }
+    delta *= 2;
+  }
+}
+
+Move AI::rootMove(Board &board, int depth, Score alpha, Score beta,
+                  std::atomic<bool> &stop, Score &outscore, Move prevPv,
+                  u64 &count,
                   std::chrono::_V2::system_clock::time_point start,
                   std::vector<MoveScore> &prevScores) {
 
@@ -126,29 +360,28 @@ Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
 
   auto moves = board.legalMoves();
 
-  Score alpha = SCORE_MIN;
-  Score beta = SCORE_MAX;
+  Score windowBeta = beta;
 
   Move refMove;
 
   if (depth > 1) {
-    auto found = table.find(node);
-    if (found != table.end()) {
-      if (found->first.depth > depth) {
-        NodeType typ = found->first.nodeType;
+    TableBucket found;
+    if (table.find(node, found)) {
+      if (found.first.depth > depth) {
+        NodeType typ = found.first.nodeType;
         if (typ == All) {
           // upper bound, the exact score might be less.
-          beta = found->second;
+          beta = min(beta, found.second);
         } else if (typ == Cut) {
           // lower bound
-          refMove = found->first.bestMove;
-          alpha = found->second;
+          refMove = found.first.bestMove;
+          alpha = max(alpha, found.second);
         } else if (typ == PV) {
-          refMove = found->first.bestMove;
+          refMove = found.first.bestMove;
         }
       } else {
         // Ideally a PV-node from prior iteration
-        refMove = found->first.bestMove;
+        refMove = found.first.bestMove;
       }
     }
   }
@@ -201,9 +434,10 @@ Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
   prevScores.clear();
   bool nullWindow = false;
   bool raisedAlpha = false;
+  bool isMain = thisThread->isMain;
 
   while (!moves.empty()) {
-    int subtreeCount = 0;
+    u64 subtreeCount = 0;
     Move mv = moves.back();
     moves.pop_back();
     board.makeMove(mv);
@@ -214,23 +448,45 @@ Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
                                    subtreeCount, All);
       if (score > alpha) {
         score = -1*AI::alphaBetaSearch(board, depth, 0, beta * -1, alpha * -1,
-                                    stop, subtreeCount, PV, true);
+                                    stop, subtreeCount, PV, isMain);
       }
     } else {
       score = -1* AI::alphaBetaSearch(board, depth, 0, beta * -1, alpha * -1, stop,
-                                  subtreeCount, PV, true);
+                                  subtreeCount, PV, isMain);
       nullWindow = true;
     }
     board.unmakeMove();
 
     count += subtreeCount;
-    prevScores.push_back(MoveScore(mv, subtreeCount));
+    thisThread->nodes = count;
+    // subtree size orders the next iteration, clamped to the int it is kept in
+    const u64 INT_LIMIT = std::numeric_limits<int>::max();
+    prevScores.push_back(MoveScore(
+        mv, (int)(subtreeCount < INT_LIMIT ? subtreeCount : INT_LIMIT)));
 
     if (stop) {
       outscore = alpha;
       return chosen; // returns best found so far
     }                // here bc if AB call stopped, it won't be full search
 
+    if (score >= windowBeta) {
+      // fail high: the caller widens the window and searches again, with
+      // the moves not searched yet still in the ordering
+      chosen = mv;
+      outscore = score;
+      node.bestMove = chosen;
+      node.nodeType = Cut;
+      table.insert(node, score);
+      while (!moves.empty()) {
+        prevScores.push_back(MoveScore(moves.back(), 0));
+        moves.pop_back();
+      }
+      if (isMain) {
+        sendCommand("info string root fail-high");
+      }
+      return chosen;
+    }
+
     if (score > alpha) {
       raisedAlpha = true;
       alpha = score;
@@ -238,11 +494,15 @@ Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
       outscore = alpha;
       node.bestMove = chosen;
       table.insert(node, alpha); // new PV found
-      sendPV(board, depth, chosen, count, alpha, start);
+      if (isMain) {
+        sendPV(board, depth, chosen, totalNodes(), alpha, start);
+      }
     }
   }
   if (!raisedAlpha) {
-    sendCommand("info string root fail-low");
+    if (isMain) {
+      sendCommand("info string root fail-low");
+    }
     outscore = alpha;
 
     return chosen;
@@ -251,7 +511,7 @@ Move AI::rootMove(Board &board, int depth, std::atomic<bool> &stop,
   return chosen;
 }
 
-void AI::sendPV(Board &board, int depth, Move pvMove, int nodeCount,
+void AI::sendPV(Board &board, int depth, Move pvMove, u64 nodeCount,
                 Score score, std::chrono::_V2::system_clock::time_point start) {
   std::string pv = " pv " + pvMove.moveToUCIAlgebraic();
   board.makeMove(pvMove);
@@ -294,28 +554,24 @@ void AI::sendPV(Board &board, int depth, Move pvMove, int nodeCount,
   sendCommand(
       "info depth " + std::to_string(max(1, depth)) + scoreStr + " time " +
       std::to_string(time) + " nps " +
-      std::to_string((int)((double)nodeCount / ((double)time / 1000.0))) +
+      std::to_string(
+          (u64)((double)nodeCount / ((double)max(time, 1) / 1000.0))) +
       " nodes " + std::to_string(nodeCount) + " hashfull " +
       std::to_string(table.ppm()) + pv);
 }
 
 Score AI::quiescence(Board &board, int depth, int plyCount, Score alpha,
-                     Score beta, std::atomic<bool> &stop, int &count,
+                     Score beta, std::atomic<bool> &stop, u64 &count,
                      int kickoff) {
 
   count++;
 
-  Score baseline = AI::flippedEval(board);
-
-  BoardStatus status = board.status();
-
-  if (status != BoardStatus::Playing) {
-    if (baseline == SCORE_MIN) {
-      return SCORE_MIN + board.dstart();
-    }
-    return baseline; // alpha vs baseline...
+  if (board.isDrawByRule()) {
+    return 0;
   }
 
+  Score baseline = AI::flippedEval(board);
+
   bool isCheck = board.isCheck();
 
   if (baseline >= beta && !isCheck)
@@ -327,26 +583,36 @@ Score AI::quiescence(Board &board, int depth, int plyCount, Score alpha,
   u64 occ = board.occupancy();
   bool deltaPrune = true && hadd(occ) > 12;
 
-  MoveVector<256> movelist = board.legalMoves(); // order by MVV-LVA?
+  bool checkKickoff = kickoff == 0 || kickoff == 2;
+
+  MoveVector<256> movelist;
+  if (isCheck) {
+    board.generateEvasions(movelist);
+    if (movelist.empty()) {
+      return SCORE_MIN + board.dstart(); // mated
+    }
+  } else {
+    board.generateCaptures(movelist);
+    if (checkKickoff) {
+      board.generateQuietChecks(movelist);
+    }
+  }
 
   std::vector<MoveScore> moves;
 
   for (int i = 0; i < movelist.size(); i++) {
     Move mv = movelist[i];
-    int see = -1;
     bool isCapture = mv.getDest() & occ;
-    if (isCapture) {
-      see = board.see(mv);
-    }
     bool isPromotion = mv.isPromotion();
-    // bool isPawn = mv.getSrc() & (board.bitboard[W_Pawn] &
-    // board.bitboard[B_Pawn]);
     bool isDeltaPrune =
         deltaPrune && isCapture &&
         (baseline + 200 + MATERIAL_TABLE[board.pieceAt(mv.getDest())] < alpha);
-    bool isCheckingMove = board.isCheckingMove(mv);
-    bool isChecking = (kickoff == 0 || kickoff == 2) && isCheckingMove &&
-                      (!isCapture || (isCapture && see >= 0 && !isDeltaPrune));
+    // only ask whether the exchange holds, and only for captures we keep
+    bool isGoodCapture = isCapture && !isDeltaPrune && board.seeGE(mv, 0);
+    // quiet checks were generated as such, only en passant is left to test
+    bool isChecking =
+        checkKickoff && !isCapture &&
+        (mv.getTypeCode() != MoveTypeCode::EnPassant || board.isCheckingMove(mv));
     int mvscore = 0;
     if (!isCapture) {
       if (isPromotion && mv.getPromotingPiece() == W_Queen) {
@@ -357,7 +623,7 @@ Score AI::quiescence(Board &board, int depth, int plyCount, Score alpha,
       //+(900-getSrc)/100
     }
 
-    if ((!isDeltaPrune && see >= 0) || isChecking || isPromotion || isCheck) {
+    if (isGoodCapture || isChecking || isPromotion || isCheck) {
       moves.push_back(MoveScore(mv, mvscore));
     }
   }
@@ -379,107 +645,223 @@ Score AI::quiescence(Board &board, int depth, int plyCount, Score alpha,
   return alpha;
 }
 
-std::vector<Move> AI::generateMovesOrdered(Board &board, Move refMove,
-                                           int plyCount,
-                                           int &numPositiveMoves) {
-  // order moves for non-qsearch
-  u64 occ = board.occupancy();
-  LazyMovegen movegen(board.occupancy(board.turn()), board.attackMap);
+// swap the best scored move at or after start into start
+Move pickBest(MoveVector<256> &moves, int *scores, int start) {
+  int best = start;
+  for (int i = start + 1; i < moves.size(); i++) {
+    if (scores[i] > scores[best]) {
+      best = i;
+    }
+  }
+  Move mv = moves.data[best];
+  int score = scores[best];
+  moves.data[best] = moves.data[start];
+  scores[best] = scores[start];
+  moves.data[start] = mv;
+  scores[start] = score;
+  return mv;
+}
 
-  std::vector<Move> hashMoves;
-  std::vector<Move> posCaptures;
-  std::vector<Move> eqCaptures;
-  std::vector<Move> heuristics;
-  std::vector<Move> negCaptures;
-  std::vector<Move> other;
+MovePicker::MovePicker(Board &board, Move hashMove, int ply)
+    : _board(board), _hashMove(hashMove), _ply(ply) {
+  _stage = PickStage::Hash;
+  _hasHashMove = false;
+  _positiveCount = 0;
+  _moveCount = 0;
+  _captureIndex = 0;
+  _badIndex = 0;
+  _killerIndex = 0;
+  _yieldedKillerCount = 0;
+  _quietIndex = 0;
+  _quietsGenerated = false;
+}
 
-  hashMoves.reserve(2);
-  posCaptures.reserve(3);
-  eqCaptures.reserve(10);
-  heuristics.reserve(3);
-  negCaptures.reserve(15);
-  other.reserve(15);
+void MovePicker::_generateCaptures() {
+  MoveVector<256> moves;
+  if (_board.isCheck()) {
+    // evasions are few, take them all now and split them
+    _board.generateEvasions(moves);
+    _quietsGenerated = true;
+  } else {
+    _board.generateCaptures(moves);
+  }
+  _moveCount += moves.size();
+  u64 occ = _board.occupancy();
+  for (int i = 0; i < moves.size(); i++) {
+    Move mv = moves[i];
+    if (_hasHashMove && mv == _hashMove) {
+      continue;
+    } else if ((mv.getDest() & occ) || mv.isPromotion() ||
+               mv.getTypeCode() == MoveTypeCode::EnPassant) {
+      _captures.push_back(mv);
+    } else {
+      _quiets.push_back(mv);
+    }
+  }
+}
 
-  std::vector<MoveScore> otherWScore;
+void MovePicker::_generateQuiets() {
+  if (!_quietsGenerated) {
+    MoveVector<256> moves;
+    _board.generateQuiets(moves);
+    _moveCount += moves.size();
+    for (int i = 0; i < moves.size(); i++) {
+      if (!(_hasHashMove && moves[i] == _hashMove)) {
+        _quiets.push_back(moves[i]);
+      }
+    }
+    _quietsGenerated = true;
+  }
+  for (int k = 0; k < _yieldedKillerCount; k++) {
+    for (int i = 0; i < _quiets.size(); i++) {
+      if (_quiets[i] == _yieldedKillers[k]) {
+        _quiets.data[i] = _quiets.back();
+        _quiets.pop_back();
+        break;
+      }
+    }
+  }
+}
 
-  Move lastMove = board.lastMove();
+bool MovePicker::_isYielded(Move mv) {
+  if (_hasHashMove && mv == _hashMove) {
+    return true;
+  }
+  for (int i = 0; i < _yieldedKillerCount; i++) {
+    if (_yieldedKillers[i] == mv) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  // priority:
-  // 0) hashmove (1)
-  // 1) winning caps (?)
-  // 2) heuristic moves: killer and counter move (2)
-  // 3) equal caps (?)
-  // 4) losingCaps (?)
-  // 5) all other, sorted by history heuristic
+// killers come from sibling nodes, so they still have to be checked here
+bool MovePicker::_isKiller(Move mv) {
+  if (mv.isNull() || _isYielded(mv)) {
+    return false;
+  }
+  if ((mv.getDest() & _board.occupancy()) || mv.isPromotion() ||
+      mv.getTypeCode() == MoveTypeCode::EnPassant) {
+    return false;
+  }
+  return _board.isLegalMove(mv);
+}
 
-  std::vector<Move> allMoves;
-  auto movelist = board.legalMoves();
-  for (int i = 0; i < movelist.size(); i++) {
-    // sort move into correct bucket
-    Move mv = movelist[i];
-    u64 dest = mv.getDest();
-    if (mv == refMove) {
-      hashMoves.push_back(mv);
-    } else if (dest & occ) {
-      int see = board.see(mv);
-      if (see > 0) {
-        posCaptures.push_back(mv);
-      } else if (see == 0) {
-        eqCaptures.push_back(mv);
+Move MovePicker::next() {
+  if (_stage == PickStage::Hash) {
+    _stage = PickStage::CaptureInit;
+    if (_board.isLegalMove(_hashMove)) {
+      _hasHashMove = true;
+      _positiveCount++;
+      return _hashMove;
+    }
+  }
+
+  if (_stage == PickStage::CaptureInit) {
+    _generateCaptures();
+    _stage = PickStage::GoodCaptures;
+    // MVV-LVA, promotions count as winning the promoted piece
+    for (int i = 0; i < _captures.size(); i++) {
+      Move mv = _captures[i];
+      PieceType victim = mv.getTypeCode() == MoveTypeCode::EnPassant
+                             ? W_Pawn
+                             : _board.pieceAt(mv.getDest());
+      int gain = MATERIAL_TABLE[victim];
+      if (mv.isPromotion()) {
+        gain += MATERIAL_TABLE[mv.getPromotingPiece()] - MATERIAL_TABLE[W_Pawn];
+      }
+      _captureScores[i] = gain * 8 - _board.pieceAt(mv.getSrc()) % 6;
+    }
+  }
+
+  if (_stage == PickStage::GoodCaptures) {
+    u64 occ = _board.occupancy();
+    while (_captureIndex < _captures.size()) {
+      Move mv = pickBest(_captures, _captureScores, _captureIndex);
+      _captureIndex++;
+      bool isBad;
+      if (mv.getDest() & occ) {
+        isBad = !_board.seeGE(mv, 0);
+      } else if (mv.isPromotion()) {
+        isBad = mv.getPromotingPiece() != W_Queen;
       } else {
-        negCaptures.push_back(mv);
+        isBad = false; // en passant
       }
-    } else if (kTable.contains(mv, plyCount)) {
-      heuristics.push_back(mv);
-    } else if (cTable.contains(lastMove, mv, board.turn())) {
-      heuristics.push_back(mv);
-    } else {
-      other.push_back(mv);
-    }
-  }
-  numPositiveMoves = posCaptures.size() + hashMoves.size() + heuristics.size();
-  allMoves.reserve(numPositiveMoves + eqCaptures.size() + other.size() +
-                   negCaptures.size());
-  // history sort
-  Color tn = board.turn();
-  for (Move mv : other) {
-    otherWScore.push_back(MoveScore(mv, hTable.get(mv, tn)));
-  }
-  allMoves.insert(allMoves.end(), negCaptures.begin(), negCaptures.end());
-  while (!otherWScore.empty()) {
-    allMoves.push_back(popMin(otherWScore));
-  }
-  allMoves.insert(allMoves.end(), eqCaptures.begin(), eqCaptures.end());
-  allMoves.insert(allMoves.end(), heuristics.begin(), heuristics.end());
-  allMoves.insert(allMoves.end(), posCaptures.begin(), posCaptures.end());
-  allMoves.insert(allMoves.end(), hashMoves.begin(), hashMoves.end());
-  return allMoves;
+      if (isBad) {
+        _badCaptures.push_back(mv);
+      } else {
+        _positiveCount++;
+        return mv;
+      }
+    }
+    _stage = PickStage::Killers;
+    KillerTable &kTable = thisThread->kTable;
+    _killers[0] = _ply < 32 ? kTable.arr[_ply][0] : Move::NullMove();
+    _killers[1] = _ply < 32 ? kTable.arr[_ply][1] : Move::NullMove();
+    _killers[2] = thisThread->cTable.get(_board.turn(), _board.lastMove());
+  }
+
+  if (_stage == PickStage::Killers) {
+    while (_killerIndex < 3) {
+      Move mv = _killers[_killerIndex];
+      _killerIndex++;
+      if (_isKiller(mv)) {
+        _yieldedKillers[_yieldedKillerCount++] = mv;
+        _positiveCount++;
+        return mv;
+      }
+    }
+    _stage = PickStage::Quiets;
+    _generateQuiets();
+    Color tn = _board.turn();
+    for (int i = 0; i < _quiets.size(); i++) {
+      _quietScores[i] = thisThread->hTable.get(_quiets[i], tn);
+    }
+  }
+  if (_stage == PickStage::Quiets) {
+    if (_quietIndex < _quiets.size()) {
+      Move mv = pickBest(_quiets, _quietScores, _quietIndex);
+      _quietIndex++;
+      return mv;
+    }
+    _stage = PickStage::BadCaptures;
+  }
+
+  if (_stage == PickStage::BadCaptures) {
+    if (_badIndex < _badCaptures.size()) {
+      Move mv = _badCaptures[_badIndex];
+      _badIndex++;
+      return mv;
+    }
+    _stage = PickStage::Done;
+  }
+
+  return Move::NullMove();
+}
+
+// score of a node that is over: mated, or drawn by stalemate or rule,
+// clamped to the window like any other fail-hard result
+Score terminalScore(Board &board, bool isMated, Score alpha, Score beta) {
+  Score score = isMated ? SCORE_MIN + board.dstart() : 0;
+  if (score < alpha) {
+    return alpha;
+  } else if (score > beta) {
+    return beta;
+  }
+  return score;
 }
 
 Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
-                          Score beta, std::atomic<bool> &stop, int &count,
+                          Score beta, std::atomic<bool> &stop, u64 &count,
                           NodeType myNodeType, bool isSave) {
   count++;
 
-  BoardStatus status = board.status();
   TableNode node(board, depth, myNodeType);
 
-  if (status != BoardStatus::Playing) {
-    Score score;
-    if (status == BoardStatus::WhiteWin || status == BoardStatus::BlackWin) {
-      score = SCORE_MIN + board.dstart();
-    } else if (status == BoardStatus::Stalemate ||
-               status == BoardStatus::Draw) {
-      score = 0;
-    } else {
-      score = AI::flippedEval(board);
-    }
-    if (score < alpha) {
-      return alpha;
-    } else if (score > beta) {
-      return beta;
-    }
-    return score;
+  // only the cheap draws here, mate and stalemate show up as a node
+  // without moves once it has generated them
+  if (board.isDrawByRule()) {
+    return terminalScore(board, false, alpha, beta);
   }
 
   if (depth <= 0) {
@@ -504,21 +886,22 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
 
   Move refMove;
 
-  auto found = table.find(node);
-  if (found != table.end()) {
+  TableBucket found;
+  if (table.find(node, found)) {
     // hits_++;
-    if (found->first.depth >= depth) { // searched already to a higher depth
-      NodeType typ = found->first.nodeType;
+    if (found.first.depth >= depth) { // searched already to a higher depth
+      NodeType typ = found.first.nodeType;
       if (typ == All) {
-        beta = min(beta, found->second);
+        beta = min(beta, found.second);
       } else if (typ == Cut) {
-        refMove = found->first.bestMove;
-        alpha = max(alpha, found->second);
+        refMove = found.first.bestMove;
+        alpha = max(alpha, found.second);
       } else if (typ == PV) {
-        refMove = found->first.bestMove;
+        refMove = found.first.bestMove;
         // reconstruct PV here
         // have to append child pv to current node
-        MiniTableBucket *currentPVNode = pvTable.find(board.zobrist());
+        MiniTableBucket *currentPVNode =
+            isSave ? pvTable.find(board.zobrist()) : pvTable.end();
         if (currentPVNode != pvTable.end()) {
           if (currentPVNode->depth < depth) {
             board.makeMove(refMove);
@@ -533,14 +916,14 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
             }
           }
         }
-        return (found->second);
+        return (found.second);
       }
       if (alpha >= beta) {
         return beta; // fail-hard fix
       }
     } else {
       // Ideally a PV-node from prior iteration
-      refMove = found->first.bestMove;
+      refMove = found.first.bestMove;
     }
   }
 
@@ -553,14 +936,10 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
   bool nullWindow = false;
   bool raisedAlpha = false;
 
-  int numPositiveMoves;
-  auto moves = generateMovesOrdered(board, refMove, plyCount, numPositiveMoves);
+  MovePicker picker(board, refMove, plyCount);
   int movesSearched = 0;
 
-  while (!moves.empty()) {
-    Move fmove = moves.back();
-    moves.pop_back();
-
+  for (Move fmove = picker.next(); fmove.notNull(); fmove = picker.next()) {
     board.makeMove(fmove);
 
     int subdepth = depth - 1;
@@ -595,9 +974,9 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
       table.insert(node, beta);
 
       if (fmove.getDest() & ~occ) {
-        hTable.insert(fmove, board.turn(), depth);
-        kTable.insert(fmove, plyCount);
-        cTable.insert(board.turn(), lastMove, fmove);
+        thisThread->hTable.insert(fmove, board.turn(), depth);
+        thisThread->kTable.insert(fmove, plyCount);
+        thisThread->cTable.insert(board.turn(), lastMove, fmove);
       }
       return beta; // fail hard
     }
@@ -609,6 +988,9 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
       alpha = score; // push up alpha
     }
   }
+  if (movesSearched == 0) {
+    return terminalScore(board, board.isCheck(), alpha, beta);
+  }
   if (!raisedAlpha) {
     node.nodeType = All;
   }
@@ -618,9 +1000,9 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
     int mc = 0;
     for (int k = 0; k < depth; k++) {
       TableNode nodeSearch(board, depth, PV);
-      auto search = table.find(nodeSearch);
-      if (search != table.end()) {
-        TableNode node = search->first;
+      TableBucket search;
+      if (table.find(nodeSearch, search)) {
+        TableNode node = search.first;
         Move mv = node.bestMove;
         movelist[k] = mv;
         board.makeMove(mv);
@@ -639,7 +1021,7 @@ Score AI::alphaBetaSearch(Board &board, int depth, int plyCount, Score alpha,
 }
 
 Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
-                           std::atomic<bool> &stop, int &count,
+                           std::atomic<bool> &stop, u64 &count,
                            NodeType myNodeType) {
   count++;
 
@@ -651,25 +1033,12 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
   bool lmr = true;
   bool futilityPrune = true;
 
-  BoardStatus status = board.status();
   TableNode node(board, depth, myNodeType);
 
-  if (status != BoardStatus::Playing) {
-    Score score;
-    if (status == BoardStatus::WhiteWin || status == BoardStatus::BlackWin) {
-      score = SCORE_MIN + board.dstart();
-    } else if (status == BoardStatus::Stalemate ||
-               status == BoardStatus::Draw) {
-      score = 0;
-    } else {
-      score = AI::flippedEval(board);
-    }
-    if (score < alpha) {
-      return alpha;
-    } else if (score > beta) {
-      return beta;
-    }
-    return score;
+  // only the cheap draws here, mate and stalemate show up as a node
+  // without moves once it has generated them
+  if (board.isDrawByRule()) {
+    return terminalScore(board, false, alpha, beta);
   }
 
   if (depth <= 0) {
@@ -686,23 +1055,23 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
 
   Move refMove;
 
-  auto found = table.find(node);
-  if (found != table.end()) {
-    if (found->first.depth >= depth) { // searched already to a higher depth
-      NodeType typ = found->first.nodeType;
+  TableBucket found;
+  if (table.find(node, found)) {
+    if (found.first.depth >= depth) { // searched already to a higher depth
+      NodeType typ = found.first.nodeType;
       if (typ == All) {
-        beta = min(beta, found->second);
+        beta = min(beta, found.second);
       } else if (typ == Cut) {
-        refMove = found->first.bestMove;
-        alpha = max(alpha, found->second);
+        refMove = found.first.bestMove;
+        alpha = max(alpha, found.second);
       } else if (typ == PV) {
-        return (found->second);
+        return (found.second);
       }
       if (alpha >= beta) {
         return beta;
       }
     } else {
-      refMove = found->first.bestMove;
+      refMove = found.first.bestMove;
     }
   }
 
@@ -712,8 +1081,10 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
   int occCount = hadd(occ);
 
   // NULL MOVE PRUNE
+  // not when stalemated, passing would turn the draw into a cutoff
   int rNull = 3;
-  if (nullmove && (!nodeIsCheck) && lastMove.notNull() && (occCount > 12)) {
+  if (nullmove && (!nodeIsCheck) && lastMove.notNull() && (occCount > 12) &&
+      board.hasLegalMove()) {
     Move mv = Move::NullMove();
     board.makeMove(mv);
     Score score =
@@ -736,15 +1107,12 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
 
   int movesSearched = 0;
 
-  int numPositiveMoves;
-  auto moves = generateMovesOrdered(board, refMove, plyCount, numPositiveMoves);
-  numPositiveMoves = max(4, numPositiveMoves);
-  int moveCount = moves.size();
+  MovePicker picker(board, refMove, plyCount);
 
-  while (!moves.empty()) {
-    Move fmove = moves.back();
-    moves.pop_back();
+  bool hasMoves = false;
 
+  for (Move fmove = picker.next(); fmove.notNull(); fmove = picker.next()) {
+    hasMoves = true;
     if (futilityPrune && (depth == 1) && (fmove != refMove) && (!nodeIsCheck) &&
         (fscore < alpha) && (fmove.getDest() & ~occ) &&
         (!board.isCheckingMove(fmove))) {
@@ -763,8 +1131,12 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
     if (board.isCheck()) {
       subdepth = depth; // Check ext
     } else if (lmr && (!nodeIsCheck) && (!isCapture) && (depth > 2) &&
-               (movesSearched > numPositiveMoves) && (!isPawnMove)) {
-      int half = numPositiveMoves + (moveCount - numPositiveMoves) / 2;
+               (movesSearched > max(4, picker.positiveCount())) &&
+               (!isPawnMove)) {
+      // only reached in the quiet stage, so both counts are final here
+      int numPositiveMoves = max(4, picker.positiveCount());
+      int half =
+          numPositiveMoves + (picker.moveCount() - numPositiveMoves) / 2;
       if (movesSearched > half) {
         subdepth = depth - 4;
       } else {
@@ -797,14 +1169,17 @@ Score AI::zeroWindowSearch(Board &board, int depth, int plyCount, Score beta,
       table.insert(node, beta);
 
       if (fmove.getDest() & ~occ) {
-        hTable.insert(fmove, board.turn(), depth);
-        kTable.insert(fmove, plyCount);
-        cTable.insert(board.turn(), lastMove, fmove);
+        thisThread->hTable.insert(fmove, board.turn(), depth);
+        thisThread->kTable.insert(fmove, plyCount);
+        thisThread->cTable.insert(board.turn(), lastMove, fmove);
       }
 
       return beta; // fail hard
     }
   }
+  if (!hasMoves) {
+    return terminalScore(board, nodeIsCheck, alpha, beta);
+  }
   node.nodeType = All;
   table.insert(node, alpha); // store node
   return alpha;
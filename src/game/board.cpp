@@ -1,287 +1,409 @@
 #include <iostream>
 #include <regex>
+#include <stdexcept>
 #include <string>
 
 #include <game/board.hpp>
 
-u64 BACK_RANK[2];
-
-u64 BISHOP_MOVE_CACHE[64][4]; // outputs a bitboard w/ ray
-u64 ROOK_MOVE_CACHE[64][4];
-
-u64 KNIGHT_MOVE_CACHE[64];
-u64 KING_MOVE_CACHE[64];
-u64 PAWN_CAPTURE_CACHE[64][2];
-u64 PAWN_MOVE_CACHE[64][2];
-u64 PAWN_DOUBLE_CACHE[64][2];
-
-u64 ONE_ADJACENT_CACHE[64];
-
-u64 CASTLE_LONG_SQUARES[2];
-u64 CASTLE_SHORT_SQUARES[2];
-u64 CASTLE_LONG_KING_SLIDE[2];
-u64 CASTLE_SHORT_KING_SLIDE[2];
-u64 CASTLE_LONG_KING_DEST[2];
-u64 CASTLE_SHORT_KING_DEST[2];
-u64 CASTLE_LONG_ROOK_DEST[2];
-u64 CASTLE_SHORT_ROOK_DEST[2];
-
-PieceSquareTable PIECE_SQUARE_TABLE[12][2]; // one for earlygame, one for
-                                            // endgame
-
-u64 ZOBRIST_HASHES[781];
-
-int SIDE_TO_MOVE_HASH_POS = 64 * 12;
-int W_LONG_HASH_POS = SIDE_TO_MOVE_HASH_POS + 1;
-int W_SHORT_HASH_POS = SIDE_TO_MOVE_HASH_POS + 2;
-int B_LONG_HASH_POS = SIDE_TO_MOVE_HASH_POS + 3;
-int B_SHORT_HASH_POS = SIDE_TO_MOVE_HASH_POS + 4;
-int EP_HASH_POS = SIDE_TO_MOVE_HASH_POS + 5;
-
-PieceType CLASSICAL_BOARD[] = { // 64 squares
-    W_Rook, W_Knight, W_Bishop, W_Queen, W_King, W_Bishop, W_Knight, W_Rook,
-    W_Pawn, W_Pawn,   W_Pawn,   W_Pawn,  W_Pawn, W_Pawn,   W_Pawn,   W_Pawn,
-    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
-    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
-    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
-    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
-    B_Pawn, B_Pawn,   B_Pawn,   B_Pawn,  B_Pawn, B_Pawn,   B_Pawn,   B_Pawn,
-    B_Rook, B_Knight, B_Bishop, B_Queen, B_King, B_Bishop, B_Knight, B_Rook};
-
-void initializeZobrist() {
-  for (int i = 0; i < 781; i++) {
-    u64 hashval = 0;
-    u64 bitmover = 1;
-    for (int k = 0; k < 64; k++) {
-      int randNum = rand100();
-      if (randNum > 50) {
-        hashval |= bitmover;
+// pext slider lookups are chosen at compile time (make bmi2), so they are
+// inlined like the magic ones instead of going through a runtime branch
+#if defined(__BMI2__) && !defined(NO_PEXT)
+#include <immintrin.h>
+#define PEXT_AVAILABLE
+#endif
+
+// Everything up to the slider magics is built by constexpr functions, so the
+// compiler computes the tables and they live in read-only data.
+typedef std::array<std::array<u64, 4>, 64> RayCache;
+typedef std::array<std::array<u64, 2>, 64> ColorCache;
+
+constexpr int ROOK_DIRS[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+constexpr int BISHOP_DIRS[4][2] = {{1, -1}, {1, 1}, {-1, 1}, {-1, -1}};
+constexpr int KING_STEPS[8][2] = {{1, 0},  {0, 1},  {-1, 0}, {0, -1},
+                                  {1, -1}, {1, 1},  {-1, 1}, {-1, -1}};
+constexpr int KNIGHT_STEPS[8][2] = {
+    {1, 2}, {1, -2}, {-1, 2}, {-1, -2}, {2, 1}, {2, -1}, {-2, 1}, {-2, -1},
+};
+
+constexpr RayCache makeRayCache(const int (&dirs)[4][2]) {
+  RayCache cache{};
+  for (int i = 0; i < 64; i++) {
+    for (int d = 0; d < 4; d++) {
+      u64 bitmap = 0;
+      int y = intToRow(i) + dirs[d][0];
+      int x = intToCol(i) + dirs[d][1];
+      while (inBounds(y, x)) {
+        bitmap |= u64FromPair(y, x);
+        y += dirs[d][0];
+        x += dirs[d][1];
       }
-      bitmover <<= 1;
+      cache[i][d] = bitmap;
     }
-    ZOBRIST_HASHES[i] = hashval;
   }
-  debugLog("Initialized zobrist hashes");
+  return cache;
 }
 
-u64 kingMoves(int i) { return KING_MOVE_CACHE[i]; }
-
-u64 getBackRank(Color c) { return BACK_RANK[c]; }
-
-u64 rookMoves(int i, int d) { return ROOK_MOVE_CACHE[i][d]; }
-
-
-
-void populateMoveCache() {
-  BACK_RANK[White] = u64FromIndex(0) | u64FromIndex(1) | u64FromIndex(2) |
-                     u64FromIndex(3) | u64FromIndex(4) | u64FromIndex(5) |
-                     u64FromIndex(6) | u64FromIndex(7);
-  BACK_RANK[Black] = u64FromIndex(56) | u64FromIndex(57) | u64FromIndex(58) |
-                     u64FromIndex(59) | u64FromIndex(60) | u64FromIndex(61) |
-                     u64FromIndex(62) | u64FromIndex(63);
-
-  const int ROOK_MOVES[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
-  const int BISHOP_MOVES[4][2] = {{1, -1}, {1, 1}, {-1, 1}, {-1, -1}};
-
-  const int KNIGHT_MOVES[8][2] = {
-      {1, 2}, {1, -2}, {-1, 2}, {-1, -2}, {2, 1}, {2, -1}, {-2, 1}, {-2, -1},
-  };
-  const int PAWN_CAPTURES[2] = {-1, 1};
-
-  CASTLE_LONG_SQUARES[White] =
-      u64FromIndex(1) | u64FromIndex(2) | u64FromIndex(3);
-  CASTLE_LONG_SQUARES[Black] =
-      u64FromIndex(57) | u64FromIndex(58) | u64FromIndex(59);
-  CASTLE_SHORT_SQUARES[White] = u64FromIndex(5) | u64FromIndex(6);
-  CASTLE_SHORT_SQUARES[Black] = u64FromIndex(61) | u64FromIndex(62);
-
-  CASTLE_LONG_KING_SLIDE[White] = u64FromIndex(2) | u64FromIndex(3);
-  CASTLE_LONG_KING_SLIDE[Black] = u64FromIndex(58) | u64FromIndex(59);
-  CASTLE_SHORT_KING_SLIDE[White] = u64FromIndex(5) | u64FromIndex(6);
-  CASTLE_SHORT_KING_SLIDE[Black] = u64FromIndex(61) | u64FromIndex(62);
-
-  CASTLE_LONG_KING_DEST[White] = u64FromIndex(2);
-  CASTLE_LONG_KING_DEST[Black] = u64FromIndex(58);
-  CASTLE_SHORT_KING_DEST[White] = u64FromIndex(6);
-  CASTLE_SHORT_KING_DEST[Black] = u64FromIndex(62);
-
-  CASTLE_LONG_ROOK_DEST[White] = u64FromIndex(3);
-  CASTLE_LONG_ROOK_DEST[Black] = u64FromIndex(59);
-  CASTLE_SHORT_ROOK_DEST[White] = u64FromIndex(5);
-  CASTLE_SHORT_ROOK_DEST[Black] = u64FromIndex(61);
-
+constexpr std::array<u64, 64> makeStepCache(const int (&steps)[8][2]) {
+  std::array<u64, 64> cache{};
   for (int i = 0; i < 64; i++) {
-    u64 bitPos = u64FromIndex(i);
-    int y0 = u64ToRow(bitPos);
-    int x0 = u64ToCol(bitPos);
-
-    // SPECIAL
-    u64 pawnAdj = 0;
-    if (inBounds(y0, x0 + 1)) {
-      pawnAdj |= u64FromPair(y0, x0 + 1);
-    }
-    if (inBounds(y0, x0 - 1)) {
-      pawnAdj |= u64FromPair(y0, x0 - 1);
-    }
-    ONE_ADJACENT_CACHE[i] = pawnAdj;
-
-    // Kings
-    u64 bitmap = 0;
-    for (int dir = 0; dir < 4; dir++) {
-      int y = y0 + ROOK_MOVES[dir][0];
-      int x = x0 + ROOK_MOVES[dir][1]; // y before x?
-      if (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
-      }
-      y = y0 + BISHOP_MOVES[dir][0];
-      x = x0 + BISHOP_MOVES[dir][1];
-      if (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
-      }
-    }
-    KING_MOVE_CACHE[i] = bitmap;
-
-    // White Pawns
-    bitmap = 0;
-    for (int dir = 0; dir < 2; dir++) {
-      int y = y0 + 1;
-      int x = x0 + PAWN_CAPTURES[dir];
+    for (int k = 0; k < 8; k++) {
+      int y = intToRow(i) + steps[k][0];
+      int x = intToCol(i) + steps[k][1];
       if (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
+        cache[i] |= u64FromPair(y, x);
       }
     }
-    PAWN_CAPTURE_CACHE[i][White] = bitmap;
-    bitmap = 0;
-    if (inBounds(y0 + 1, x0)) {
-      bitmap |= u64FromPair(y0 + 1, x0);
-    }
-    PAWN_MOVE_CACHE[i][White] = bitmap;
+  }
+  return cache;
+}
 
-    bitmap = 0;
-    if (y0 == 1) {
-      bitmap |= u64FromPair(y0 + 2, x0);
-    }
-    PAWN_DOUBLE_CACHE[i][White] = bitmap;
+enum PawnCacheKind { PawnCaptures, PawnMoves, PawnDoubles };
 
-    // Black Pawns
-    bitmap = 0;
-    for (int dir = 0; dir < 2; dir++) {
-      int y = y0 - 1;
-      int x = x0 + PAWN_CAPTURES[dir];
-      if (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
+constexpr ColorCache makePawnCache(PawnCacheKind kind) {
+  ColorCache cache{};
+  for (int i = 0; i < 64; i++) {
+    int y0 = intToRow(i);
+    int x0 = intToCol(i);
+    for (Color c = White; c <= Black; c++) {
+      int forward = c == White ? 1 : -1;
+      int startRow = c == White ? 1 : 6;
+      u64 bitmap = 0;
+      if (kind == PawnCaptures) {
+        for (int dx = -1; dx <= 1; dx += 2) {
+          if (inBounds(y0 + forward, x0 + dx)) {
+            bitmap |= u64FromPair(y0 + forward, x0 + dx);
+          }
+        }
+      } else if (kind == PawnMoves) {
+        if (inBounds(y0 + forward, x0)) {
+          bitmap |= u64FromPair(y0 + forward, x0);
+        }
+      } else if (y0 == startRow) {
+        bitmap |= u64FromPair(y0 + 2 * forward, x0);
       }
+      cache[i][c] = bitmap;
     }
-    PAWN_CAPTURE_CACHE[i][Black] = bitmap;
-    bitmap = 0;
-    if (inBounds(y0 - 1, x0)) {
-      bitmap |= u64FromPair(y0 - 1, x0);
-    }
-    PAWN_MOVE_CACHE[i][Black] = bitmap;
-
-    bitmap = 0;
-    if (y0 == 6) {
-      bitmap |= u64FromPair(y0 - 2, x0);
-    }
-    PAWN_DOUBLE_CACHE[i][Black] = bitmap;
+  }
+  return cache;
+}
 
-    // Knights
-    bitmap = 0;
-    for (int dir = 0; dir < 8; dir++) {
-      int y = y0 + KNIGHT_MOVES[dir][0];
-      int x = x0 + KNIGHT_MOVES[dir][1];
-      if (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
+constexpr std::array<u64, 64> makeAdjacentCache() {
+  std::array<u64, 64> cache{};
+  for (int i = 0; i < 64; i++) {
+    for (int dx = -1; dx <= 1; dx += 2) {
+      if (inBounds(intToRow(i), intToCol(i) + dx)) {
+        cache[i] |= u64FromPair(intToRow(i), intToCol(i) + dx);
       }
     }
-    KNIGHT_MOVE_CACHE[i] = bitmap;
+  }
+  return cache;
+}
 
-    // Bishops
-    for (int dir = 0; dir < 4; dir++) {
-      u64 bitmap = 0;
-      int dy = BISHOP_MOVES[dir][0];
-      int dx = BISHOP_MOVES[dir][1];
-      int y = y0 + dy;
-      int x = x0 + dx;
-      while (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
-        y += dy;
-        x += dx;
-      }
-      BISHOP_MOVE_CACHE[i][dir] = bitmap;
-    }
+constexpr RayCache ROOK_MOVE_CACHE = makeRayCache(ROOK_DIRS);
+constexpr RayCache BISHOP_MOVE_CACHE = makeRayCache(BISHOP_DIRS);
 
-    // Rooks
-    for (int dir = 0; dir < 4; dir++) {
-      u64 bitmap = 0;
-      int dy = ROOK_MOVES[dir][0];
-      int dx = ROOK_MOVES[dir][1];
-      int y = y0 + dy;
-      int x = x0 + dx;
-      while (inBounds(y, x)) {
-        bitmap |= u64FromPair(y, x);
-        y += dy;
-        x += dx;
+constexpr std::array<std::array<u64, 64>, 64>
+makeBetweenCache(const RayCache &rooks, const RayCache &bishops) {
+  std::array<std::array<u64, 64>, 64> cache{};
+  for (int i = 0; i < 64; i++) {
+    for (int d = 0; d < 4; d++) {
+      for (int k = 0; k < 64; k++) {
+        if (rooks[i][d] & u64FromIndex(k)) {
+          cache[i][k] = rooks[i][d] & ~rooks[k][d] & ~u64FromIndex(k);
+        }
+        if (bishops[i][d] & u64FromIndex(k)) {
+          cache[i][k] = bishops[i][d] & ~bishops[k][d] & ~u64FromIndex(k);
+        }
       }
-      ROOK_MOVE_CACHE[i][dir] = bitmap;
     }
   }
-  debugLog("Initialized move cache");
+  return cache;
+}
 
-  // init piece squares
+SliderMagic ROOK_MAGICS[64];
+SliderMagic BISHOP_MAGICS[64];
+u64 ROOK_ATTACK_TABLE[102400]; // sum over squares of 2^(relevant blockers)
+u64 BISHOP_ATTACK_TABLE[5248];
+#ifdef PEXT_AVAILABLE
+const bool USE_PEXT = true;
+#else
+const bool USE_PEXT = false;
+#endif
+
+constexpr std::array<u64, 64> KNIGHT_MOVE_CACHE = makeStepCache(KNIGHT_STEPS);
+constexpr std::array<u64, 64> KING_MOVE_CACHE = makeStepCache(KING_STEPS);
+constexpr ColorCache PAWN_CAPTURE_CACHE = makePawnCache(PawnCaptures);
+constexpr ColorCache PAWN_MOVE_CACHE = makePawnCache(PawnMoves);
+constexpr ColorCache PAWN_DOUBLE_CACHE = makePawnCache(PawnDoubles);
+
+constexpr std::array<u64, 64> ONE_ADJACENT_CACHE = makeAdjacentCache();
+// squares strictly between two aligned squares
+constexpr std::array<std::array<u64, 64>, 64> BETWEEN_CACHE =
+    makeBetweenCache(ROOK_MOVE_CACHE, BISHOP_MOVE_CACHE);
+
+constexpr u64 BACK_RANK[2] = {0xFFULL, 0xFFULL << 56};
+
+constexpr u64 CASTLE_LONG_SQUARES[2] = {0xEULL, 0xEULL << 56};
+constexpr u64 CASTLE_SHORT_SQUARES[2] = {0x60ULL, 0x60ULL << 56};
+constexpr u64 CASTLE_LONG_KING_SLIDE[2] = {0xCULL, 0xCULL << 56};
+constexpr u64 CASTLE_SHORT_KING_SLIDE[2] = {0x60ULL, 0x60ULL << 56};
+constexpr u64 CASTLE_LONG_KING_DEST[2] = {u64FromIndex(2), u64FromIndex(58)};
+constexpr u64 CASTLE_SHORT_KING_DEST[2] = {u64FromIndex(6), u64FromIndex(62)};
+constexpr u64 CASTLE_LONG_ROOK_DEST[2] = {u64FromIndex(3), u64FromIndex(59)};
+constexpr u64 CASTLE_SHORT_ROOK_DEST[2] = {u64FromIndex(5), u64FromIndex(61)};
+
+typedef std::array<std::array<PieceSquareTable, 2>, 12> PieceSquareTables;
+
+constexpr PieceSquareTables makePieceSquareTables() {
+  PieceSquareTables tables{};
   for (int row = 0; row < 8; row++) {
     for (int col = 0; col < 8; col++) {
       int index = intFromPair(row, col);
       // weight pawns lower and kings higher
       float rr = ((float)row) / 14.0;
       float r7 = ((float)(7 - row)) / 14.0;
-      PIECE_SQUARE_TABLE[W_Pawn][0].set(index, rr);
-      PIECE_SQUARE_TABLE[W_Pawn][1].set(index, rr);
-      PIECE_SQUARE_TABLE[B_Pawn][0].set(index, r7);
-      PIECE_SQUARE_TABLE[B_Pawn][1].set(index, r7);
+      tables[W_Pawn][0].set(index, rr);
+      tables[W_Pawn][1].set(index, rr);
+      tables[B_Pawn][0].set(index, r7);
+      tables[B_Pawn][1].set(index, r7);
 
       r7 = 7 - distToClosestCorner(row, col);
       rr = distToClosestCorner(row, col);
       r7 /= 7.0;
       rr /= 7.0;
-      PIECE_SQUARE_TABLE[W_King][0].set(index, r7);
-      PIECE_SQUARE_TABLE[B_King][0].set(index, r7);
-      PIECE_SQUARE_TABLE[W_King][1].set(index, rr);
-      PIECE_SQUARE_TABLE[B_King][1].set(index, rr);
+      tables[W_King][0].set(index, r7);
+      tables[B_King][0].set(index, r7);
+      tables[W_King][1].set(index, rr);
+      tables[B_King][1].set(index, rr);
 
-      float nmoves = hadd(KNIGHT_MOVE_CACHE[index]);
+      float nmoves = __builtin_popcountll(KNIGHT_MOVE_CACHE[index]);
       nmoves /= 8.0;
-      PIECE_SQUARE_TABLE[W_Knight][0].set(index, nmoves);
-      PIECE_SQUARE_TABLE[W_Knight][1].set(index, nmoves);
-      PIECE_SQUARE_TABLE[B_Knight][0].set(index, nmoves);
-      PIECE_SQUARE_TABLE[B_Knight][1].set(index, nmoves);
-
       float bmoves = 0;
       float rmoves = 0;
       for (int d = 0; d < 4; d++) {
-        bmoves += hadd(BISHOP_MOVE_CACHE[index][d]);
-        rmoves += hadd(ROOK_MOVE_CACHE[index][d]);
+        bmoves += __builtin_popcountll(BISHOP_MOVE_CACHE[index][d]);
+        rmoves += __builtin_popcountll(ROOK_MOVE_CACHE[index][d]);
       }
       float qmoves = bmoves + rmoves;
       bmoves /= 21.0;
       rmoves /= 14.0;
       qmoves /= 54.0;
-      PIECE_SQUARE_TABLE[W_Bishop][0].set(index, bmoves);
-      PIECE_SQUARE_TABLE[W_Bishop][1].set(index, bmoves);
-      PIECE_SQUARE_TABLE[B_Bishop][0].set(index, bmoves);
-      PIECE_SQUARE_TABLE[B_Bishop][1].set(index, bmoves);
-      PIECE_SQUARE_TABLE[W_Rook][0].set(index, rmoves);
-      PIECE_SQUARE_TABLE[W_Rook][1].set(index, rmoves);
-      PIECE_SQUARE_TABLE[B_Rook][0].set(index, rmoves);
-      PIECE_SQUARE_TABLE[B_Rook][1].set(index, rmoves);
-      PIECE_SQUARE_TABLE[W_Queen][0].set(index, qmoves);
-      PIECE_SQUARE_TABLE[W_Queen][1].set(index, qmoves);
-      PIECE_SQUARE_TABLE[B_Queen][0].set(index, qmoves);
-      PIECE_SQUARE_TABLE[B_Queen][1].set(index, qmoves);
+      for (int phase = 0; phase < 2; phase++) {
+        for (Color c = White; c <= Black; c++) {
+          tables[W_Knight + 6 * c][phase].set(index, nmoves);
+          tables[W_Bishop + 6 * c][phase].set(index, bmoves);
+          tables[W_Rook + 6 * c][phase].set(index, rmoves);
+          tables[W_Queen + 6 * c][phase].set(index, qmoves);
+        }
+      }
+    }
+  }
+  return tables;
+}
+
+// one for earlygame, one for endgame
+constexpr PieceSquareTables PIECE_SQUARE_TABLE = makePieceSquareTables();
+
+constexpr std::array<u64, 781> makeZobristKeys() {
+  // splitmix64 from a fixed seed
+  std::array<u64, 781> keys{};
+  u64 state = 13194;
+  for (int i = 0; i < 781; i++) {
+    state += 0x9E3779B97F4A7C15ULL;
+    u64 z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    keys[i] = z ^ (z >> 31);
+  }
+  return keys;
+}
+
+constexpr std::array<u64, 781> ZOBRIST_HASHES = makeZobristKeys();
+
+const int SIDE_TO_MOVE_HASH_POS = 64 * 12;
+const int W_LONG_HASH_POS = SIDE_TO_MOVE_HASH_POS + 1;
+const int W_SHORT_HASH_POS = SIDE_TO_MOVE_HASH_POS + 2;
+const int B_LONG_HASH_POS = SIDE_TO_MOVE_HASH_POS + 3;
+const int B_SHORT_HASH_POS = SIDE_TO_MOVE_HASH_POS + 4;
+const int EP_HASH_POS = SIDE_TO_MOVE_HASH_POS + 5;
+
+PieceType CLASSICAL_BOARD[] = { // 64 squares
+    W_Rook, W_Knight, W_Bishop, W_Queen, W_King, W_Bishop, W_Knight, W_Rook,
+    W_Pawn, W_Pawn,   W_Pawn,   W_Pawn,  W_Pawn, W_Pawn,   W_Pawn,   W_Pawn,
+    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
+    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
+    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
+    Empty,  Empty,    Empty,    Empty,   Empty,  Empty,    Empty,    Empty,
+    B_Pawn, B_Pawn,   B_Pawn,   B_Pawn,  B_Pawn, B_Pawn,   B_Pawn,   B_Pawn,
+    B_Rook, B_Knight, B_Bishop, B_Queen, B_King, B_Bishop, B_Knight, B_Rook};
+
+u64 kingMoves(int i) { return KING_MOVE_CACHE[i]; }
+
+u64 getBackRank(Color c) { return BACK_RANK[c]; }
+
+u64 rookMoves(int i, int d) { return ROOK_MOVE_CACHE[i][d]; }
+
+u64 rookAttacks(int i, u64 occupants) {
+  SliderMagic &m = ROOK_MAGICS[i];
+#ifdef PEXT_AVAILABLE
+  return m.attacks[_pext_u64(occupants, m.mask)];
+#else
+  return m.attacks[m.index(occupants)];
+#endif
+}
+
+u64 bishopAttacks(int i, u64 occupants) {
+  SliderMagic &m = BISHOP_MAGICS[i];
+#ifdef PEXT_AVAILABLE
+  return m.attacks[_pext_u64(occupants, m.mask)];
+#else
+  return m.attacks[m.index(occupants)];
+#endif
+}
+
+std::string sliderBackend() { return USE_PEXT ? "pext" : "magic"; }
+
+// Ray-by-ray attack set, only used to fill the magic tables
+u64 slidingAttacks(const RayCache &rayCache, int index, u64 occupants) {
+  u64 result = 0;
+  for (int d = 0; d < 4; d++) {
+    u64 ray = rayCache[index][d];
+    u64 overlaps = ray & occupants;
+    if (overlaps) {
+      if (d < 2) {
+        ray &= ~rayCache[bitscanForward(overlaps)][d];
+      } else {
+        ray &= ~rayCache[bitscanReverse(overlaps)][d];
+      }
+    }
+    result |= ray;
+  }
+  return result;
+}
+
+// found once by a random search over sparse candidates (xorshift64*,
+// seed 1070372); every blocker subset lands on a slot holding its attacks
+constexpr u64 ROOK_MAGIC_NUMBERS[64] = {
+    0x0080068051E04000ULL, 0x0040001000402000ULL, 0x0080100020008008ULL,
+    0x4E000A0010208440ULL, 0x4200040802002010ULL, 0x0100010008020400ULL,
+    0x9080608019000600ULL, 0x8100020080204100ULL, 0x4103800480400020ULL,
+    0x8015004004802100ULL, 0x000200108A002040ULL, 0x0801000821001000ULL,
+    0x0015000500080070ULL, 0x0120800400800200ULL, 0x0109000432001100ULL,
+    0x020080055B000080ULL, 0x0080004000402002ULL, 0x5260848020004008ULL,
+    0x2402020014402080ULL, 0x3000808010000802ULL, 0x0304018004810800ULL,
+    0x0000808004000200ULL, 0x0002040001500248ULL, 0x0012020000408401ULL,
+    0x8440008080004020ULL, 0x0804200840100040ULL, 0x0820008080201000ULL,
+    0x2080100100082100ULL, 0x0001000500100800ULL, 0x00A1000900028400ULL,
+    0x0100100400C80102ULL, 0x000001120000A044ULL, 0x800080C004800620ULL,
+    0x4040081000202000ULL, 0x0D08802008801000ULL, 0x1000800800801004ULL,
+    0x1004000801010010ULL, 0x0402800400800200ULL, 0x0004080204008110ULL,
+    0x0000404082000401ULL, 0x00C0118861408000ULL, 0x1100220081020048ULL,
+    0x09A0430420050010ULL, 0x0000082200420010ULL, 0x2110080004008080ULL,
+    0x2004201040680104ULL, 0x1106001451820008ULL, 0x0002224104820014ULL,
+    0x00800C8044210500ULL, 0x02A0200040100040ULL, 0x040100A0001E4100ULL,
+    0x00204023108A0200ULL, 0x2400080080040080ULL, 0x1289008400020900ULL,
+    0x0002088250010400ULL, 0x0001006084010200ULL, 0x0001023480002141ULL,
+    0x0006400021810015ULL, 0x8400100840200101ULL, 0x40003000A1000825ULL,
+    0x1002011008200402ULL, 0x100D000400080201ULL, 0x0020048806102904ULL,
+    0x8401000020804201ULL,
+};
+
+constexpr u64 BISHOP_MAGIC_NUMBERS[64] = {
+    0x4C40240122060016ULL, 0x8048110404004A80ULL, 0x8004440410414020ULL,
+    0x021C410060405000ULL, 0x80CD1040D0480812ULL, 0x0002021104000082ULL,
+    0x08440082A8200001ULL, 0x00202A0800841002ULL, 0x0200C40810842088ULL,
+    0x60C0081000C08901ULL, 0x00A3D0040042510CULL, 0x1C00110400808541ULL,
+    0x0400820211084005ULL, 0x0000008860080800ULL, 0x002002020202C000ULL,
+    0x0400344E08040A81ULL, 0x812800102098A080ULL, 0x00202010823A2040ULL,
+    0x4086400800830201ULL, 0x5008012A22004000ULL, 0x0004801C00A00000ULL,
+    0x0000400200505400ULL, 0x0480408401080820ULL, 0x8000400029082824ULL,
+    0x0008880804501000ULL, 0x0001600048084100ULL, 0x0108220624040400ULL,
+    0x0008080000820002ULL, 0xC804040010410041ULL, 0x01080A0040208400ULL,
+    0x2018030480A88800ULL, 0x4040410020410810ULL, 0x1108044010100210ULL,
+    0x084A100400029800ULL, 0x0801080100820C00ULL, 0x8010400808108200ULL,
+    0x0084008400020500ULL, 0x0002004200290481ULL, 0x0010150200032090ULL,
+    0x8404042220404102ULL, 0x0302080308004008ULL, 0x1200420820000408ULL,
+    0x0802002024200800ULL, 0x4020824208000084ULL, 0x000002020C008200ULL,
+    0x2C40208081000882ULL, 0x2082223441000401ULL, 0x8804080081101020ULL,
+    0x4401011002220808ULL, 0x81020C4202100000ULL, 0x4005004404040308ULL,
+    0x0820400C42020001ULL, 0x0020206421820010ULL, 0x0150401001424008ULL,
+    0x02A20242020C0608ULL, 0x5020110109011200ULL, 0x2050840108410401ULL,
+    0x0100090880842108ULL, 0x220008960142187AULL, 0x1111028880208820ULL,
+    0x4400200042028200ULL, 0x4400010802084206ULL, 0x0000400242040100ULL,
+    0x0002201104010944ULL,
+};
+
+void initializeMagics(const RayCache &rayCache, const u64 *magicNumbers,
+                      SliderMagic *magics, u64 *table) {
+  std::array<u64, 4096> occupancies;
+  std::array<u64, 4096> reference;
+  std::array<int, 4096> epoch;
+  u64 *next = table;
+
+  for (int i = 0; i < 64; i++) {
+    SliderMagic &m = magics[i];
+    // a blocker on the last square of a ray never shortens it
+    m.mask = 0;
+    for (int d = 0; d < 4; d++) {
+      u64 ray = rayCache[i][d];
+      if (ray) {
+        int edge = d < 2 ? bitscanReverse(ray) : bitscanForward(ray);
+        m.mask |= ray & ~u64FromIndex(edge);
+      }
+    }
+    m.shift = 64 - hadd(m.mask);
+    m.attacks = next;
+
+    // enumerate every blocker subset of the mask (carry-rippler)
+    int size = 0;
+    u64 subset = 0;
+    do {
+      occupancies[size] = subset;
+      reference[size] = slidingAttacks(rayCache, i, subset);
+      epoch[size] = 0;
+      size++;
+      subset = (subset - m.mask) & m.mask;
+    } while (subset);
+    next += size;
+
+    if (USE_PEXT) {
+      // the carry-rippler walks subsets in pext order, so slot k is subset k
+      m.magic = 0;
+      for (int k = 0; k < size; k++) {
+        m.attacks[k] = reference[k];
+      }
+      continue;
+    }
+
+    m.magic = magicNumbers[i];
+    for (int k = 0; k < size; k++) {
+      unsigned idx = m.index(occupancies[k]);
+      if (epoch[idx] == i + 1 && m.attacks[idx] != reference[k]) {
+        debugLog("Bad magic number for square " + std::to_string(i));
+        throw;
+      }
+      epoch[idx] = i + 1;
+      m.attacks[idx] = reference[k];
     }
   }
 }
 
+void populateMoveCache() {
+  // the slider tables depend on the build, everything else is constexpr
+#ifdef PEXT_AVAILABLE
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("bmi2")) {
+    debugLog("built for bmi2, which this CPU lacks");
+    throw std::runtime_error("built for bmi2, which this CPU lacks");
+  }
+#endif
+  initializeMagics(ROOK_MOVE_CACHE, ROOK_MAGIC_NUMBERS, ROOK_MAGICS,
+                   ROOK_ATTACK_TABLE);
+  initializeMagics(BISHOP_MOVE_CACHE, BISHOP_MAGIC_NUMBERS, BISHOP_MAGICS,
+                   BISHOP_ATTACK_TABLE);
+  debugLog("Initialized move cache (" + sliderBackend() + " sliders)");
+}
+
 void Board::_generatePseudoLegal() {
   // generate attack-defend sets
   for (int i = 0; i < 64; i++) {
@@ -359,8 +481,82 @@ void Board::_generatePseudoLegal() {
       defendMap[defenderIndex] |= attackerSq;
     }
   }
+}
+
+u64 Board::_attacksFrom(int index, u64 occupants) {
+  switch (mailbox[index]) {
+  case W_Pawn:
+    return PAWN_CAPTURE_CACHE[index][White];
+  case B_Pawn:
+    return PAWN_CAPTURE_CACHE[index][Black];
+  case W_Knight:
+  case B_Knight:
+    return KNIGHT_MOVE_CACHE[index];
+  case W_Bishop:
+  case B_Bishop:
+    return bishopAttacks(index, occupants);
+  case W_Rook:
+  case B_Rook:
+    return rookAttacks(index, occupants);
+  case W_Queen:
+  case B_Queen:
+    return bishopAttacks(index, occupants) | rookAttacks(index, occupants);
+  case W_King:
+  case B_King:
+    return KING_MOVE_CACHE[index];
+  }
+  return 0;
+}
+
+void Board::_updatePseudoLegal(u64 changed) {
+  // Only the pieces on changed squares and the sliders that attacked one of
+  // them (their rays now stop earlier or run further) can have new attacks.
+  // defendMap still describes the position before the change here.
+  u64 occ = occupancy();
+  u64 sliders = bitboard[W_Bishop] | bitboard[B_Bishop] | bitboard[W_Rook] |
+                bitboard[B_Rook] | bitboard[W_Queen] | bitboard[B_Queen];
+  u64 affected = changed;
+  u64 x = changed;
+  while (x) {
+    int k = bitscanForward(x);
+    x &= x - 1;
+    affected |= defendMap[k] & sliders;
+  }
+
+  while (affected) {
+    int i = bitscanForward(affected);
+    affected &= affected - 1;
+    u64 before = attackMap[i];
+    u64 after = _attacksFrom(i, occ);
+    if (before == after) {
+      continue;
+    }
+    attackMap[i] = after;
+    u64 attackerSq = u64FromIndex(i);
+    u64 lost = before & ~after;
+    while (lost) {
+      int k = bitscanForward(lost);
+      lost &= lost - 1;
+      defendMap[k] &= ~attackerSq;
+    }
+    u64 gained = after & ~before;
+    while (gained) {
+      int k = bitscanForward(gained);
+      gained &= gained - 1;
+      defendMap[k] |= attackerSq;
+    }
+  }
 
-  _pseudoStack.push_back(PseudoLegalData(attackMap, defendMap));
+#ifdef DEBUG
+  std::array<u64, 64> aMap = attackMap;
+  std::array<u64, 64> dMap = defendMap;
+  _generatePseudoLegal();
+  if (aMap != attackMap || dMap != defendMap) {
+    dump(true);
+    debugLog("incremental attack maps diverged from full rebuild");
+    throw;
+  }
+#endif
 }
 
 u64 Board::_isUnderAttack(u64 target) {
@@ -380,33 +576,88 @@ u64 Board::_isUnderAttack(u64 target, Color byWho) {
 
 bool Board::isCheck() {
   Color color = turn();
-  u64 kingBB = bitboard[W_King + 6 * color];
-  return _isUnderAttack(kingBB, flipColor(color));
+  int kingIndex = u64ToIndex(bitboard[W_King + 6 * color]);
+  return defendMap[kingIndex] & occupancy(flipColor(color));
 }
 
-PieceType Board::pieceAt(u64 space, Color c) {
-  PieceType s = pieceIndexFromColor(c);
-  // temporary solution
-  for (PieceType i = s; i < s + 6; i++) {
-    if (space & bitboard[i]) {
-      return i;
-    }
-  }
-  return Empty;
+void Board::_computeLegalityInfo() {
+  // checkers, and for each piece of the side to move that is the only
+  // blocker between its king and an enemy slider, the squares it may still
+  // move to (up to and including the pinner)
+  Color color = turn();
+  Color enemyColor = flipColor(color);
+  int offset = 6 * enemyColor;
+  int kingIndex = u64ToIndex(bitboard[W_King + 6 * color]);
+  u64 occ = occupancy();
+  u64 snipers =
+      (rookAttacks(kingIndex, 0) &
+       (bitboard[W_Rook + offset] | bitboard[W_Queen + offset])) |
+      (bishopAttacks(kingIndex, 0) &
+       (bitboard[W_Bishop + offset] | bitboard[W_Queen + offset]));
+
+  _checkers = defendMap[kingIndex] & occupancy(enemyColor);
+  _pinned = 0;
+  while (snipers) {
+    int s = bitscanForward(snipers);
+    snipers &= snipers - 1;
+    u64 between = BETWEEN_CACHE[kingIndex][s];
+    u64 blockers = between & occ;
+    if (blockers && !(blockers & (blockers - 1)) &&
+        (blockers & occupancy(color))) {
+      _pinned |= blockers;
+      _pinRay[bitscanForward(blockers)] = between | u64FromIndex(s);
+    }
+  }
+  _hasLegalityInfo = true;
 }
 
-Board::Board() { reset(); }
+void Board::_computeCheckInfo() {
+  // squares from which each piece kind of the side to move would attack the
+  // enemy king, and the pieces of the side to move that are the only blocker
+  // between one of their own sliders and that king
+  Color color = turn();
+  Color enemyColor = flipColor(color);
+  int offset = 6 * color;
+  int kingIndex = u64ToIndex(bitboard[W_King + 6 * enemyColor]);
+  u64 occ = occupancy();
 
-PieceType Board::pieceAt(u64 space) {
-  // temporary solution
-  for (PieceType i = 0; i < Empty; i++) {
-    if (space & bitboard[i]) {
-      return i;
-    }
-  }
-  return Empty;
+  _checkSquares[W_Pawn] = PAWN_CAPTURE_CACHE[kingIndex][enemyColor];
+  _checkSquares[W_Knight] = KNIGHT_MOVE_CACHE[kingIndex];
+  _checkSquares[W_Bishop] = bishopAttacks(kingIndex, occ);
+  _checkSquares[W_Rook] = rookAttacks(kingIndex, occ);
+  _checkSquares[W_Queen] = _checkSquares[W_Bishop] | _checkSquares[W_Rook];
+  _checkSquares[W_King] = 0;
+
+  u64 snipers =
+      (rookAttacks(kingIndex, 0) &
+       (bitboard[W_Rook + offset] | bitboard[W_Queen + offset])) |
+      (bishopAttacks(kingIndex, 0) &
+       (bitboard[W_Bishop + offset] | bitboard[W_Queen + offset]));
+
+  _discoverers = 0;
+  while (snipers) {
+    int s = bitscanForward(snipers);
+    snipers &= snipers - 1;
+    u64 between = BETWEEN_CACHE[kingIndex][s];
+    u64 blockers = between & occ;
+    if (blockers && !(blockers & (blockers - 1)) &&
+        (blockers & occupancy(color))) {
+      _discoverers |= blockers;
+      _discoverRay[bitscanForward(blockers)] = between | u64FromIndex(s);
+    }
+  }
+  _hasCheckInfo = true;
+}
+
+PieceType Board::pieceAt(u64 space, Color c) {
+  PieceType piece = mailbox[u64ToIndex(space)];
+  return colorOf(piece) == c ? piece : Empty;
 }
 
+Board::Board() : prefetch(nullptr) { reset(); }
+
+PieceType Board::pieceAt(u64 space) { return mailbox[u64ToIndex(space)]; }
+
 Move Board::moveFromAlgebraic(const std::string &alg) {
   // shortcut way
   auto moves = legalMoves();
@@ -509,26 +760,30 @@ std::string Board::moveToAlgebraic(Move mv) {
   return result;
 }
 
+bool Board::isDrawByRule() {
+  if (boardState[HAS_REPEATED_INDEX] == 1 || boardState[HALFMOVE_INDEX] >= 50) {
+    return true;
+  }
+  if (hadd(bitboard[W_Pawn] | bitboard[B_Pawn] | bitboard[B_Queen] |
+           bitboard[W_Queen] | bitboard[W_Rook] | bitboard[B_Rook]) == 0) {
+    // if either side has at least two minor pieces and one bishop
+    // not a draw
+    if (!((hadd(bitboard[W_Bishop] | bitboard[W_Knight]) >= 2 &&
+           hadd(bitboard[W_Bishop]) > 0) ||
+          (hadd(bitboard[B_Bishop] | bitboard[B_Knight]) >= 2 &&
+           hadd(bitboard[B_Bishop]) > 0))) {
+      return true;
+    }
+  }
+  return false;
+}
+
 BoardStatus Board::status() {
   if (_status == BoardStatus::NotCalculated) {
-    if (boardState[HAS_REPEATED_INDEX] == 1 || boardState[HALFMOVE_INDEX] >= 50) {
+    if (isDrawByRule()) {
       _status = BoardStatus::Draw;
       return _status;
     }
-    // calculate
-
-    if (hadd(bitboard[W_Pawn] | bitboard[B_Pawn] | bitboard[B_Queen] |
-             bitboard[W_Queen] | bitboard[W_Rook] | bitboard[B_Rook]) == 0) {
-      // if either side has at least two minor pieces and one bishop
-      // not a draw
-      if (!((hadd(bitboard[W_Bishop] | bitboard[W_Knight]) >= 2 &&
-             hadd(bitboard[W_Bishop]) > 0) ||
-            (hadd(bitboard[B_Bishop] | bitboard[B_Knight]) >= 2 &&
-             hadd(bitboard[B_Bishop]) > 0))) {
-        _status = BoardStatus::Draw;
-        return _status;
-      }
-    }
     if (isCheck()) {
       auto movelist = produceUncheckMoves();
       if (movelist.empty()) {
@@ -537,9 +792,7 @@ BoardStatus Board::status() {
         return _status;
       }
     } else {
-      LazyMovegen movegen(occupancy(turn()), attackMap);
-      Move mv = nextMove(movegen);
-      if (mv.isNull()) {
+      if (!hasLegalMove()) {
         _status = BoardStatus::Stalemate;
         return _status;
       }
@@ -572,6 +825,7 @@ void Board::_removePiece(PieceType p, u64 location) {
   int ind = u64ToIndex(location);
   u64 hash = ZOBRIST_HASHES[64 * p + ind];
   _zobristHash ^= hash;
+  _changedSquares |= location;
   pieceScoreEarlyGame[p] -= PIECE_SQUARE_TABLE[p][0].at(ind);
   pieceScoreLateGame[p] -= PIECE_SQUARE_TABLE[p][1].at(ind);
   /*} else {
@@ -583,6 +837,9 @@ void Board::_removePiece(PieceType p, u64 location) {
     throw;
   }*/
   bitboard[p] &= ~location;
+  _colorOccupancy[p < 6 ? White : Black] &= ~location;
+  _occupied &= ~location;
+  mailbox[ind] = Empty;
 }
 
 void Board::_addPiece(PieceType p,
@@ -604,17 +861,35 @@ void Board::_addPiece(PieceType p,
   pieceScoreEarlyGame[p] += PIECE_SQUARE_TABLE[p][0].at(ind);
   pieceScoreLateGame[p] += PIECE_SQUARE_TABLE[p][1].at(ind);
   bitboard[p] |= location;
-
-  // inc update attack/defend maps
-  // for attack: calc at old square, remove from u64
-  //  calc at new square, add to
+  _colorOccupancy[p < 6 ? White : Black] |= location;
+  _occupied |= location;
+  mailbox[ind] = p;
+  _changedSquares |= location;
 }
 
 void Board::makeMove(Move mv) {
+  if (turn() == White) {
+    _makeMove<White>(mv);
+  } else {
+    _makeMove<Black>(mv);
+  }
+}
+
+template <Color C> void Board::_makeMove(Move mv) {
+  const Color Them = 1 - C;
+  const PieceType Pawn = W_Pawn + 6 * C;
+  const PieceType King = W_King + 6 * C;
+  const PieceType Rook = W_Rook + 6 * C;
+  const PieceType TheirPawn = W_Pawn + 6 * Them;
+  const PieceType TheirRook = W_Rook + 6 * Them;
+
   _status = BoardStatus::NotCalculated;
+  _hasLegalityInfo = false;
+  _hasCheckInfo = false;
 
   // copy old data and move onto stack
   stack.push(boardState, mv, zobrist());
+  _changedSquares = 0;
 
   int moveType = mv.getTypeCode();
 
@@ -622,15 +897,15 @@ void Board::makeMove(Move mv) {
   boardState[LAST_CAPTURED_INDEX] = Empty;
 
   if (moveType != MoveTypeCode::Null) {
-    Color c = turn();
     u64 src = mv.getSrc();
     u64 dest = mv.getDest();
     PieceType mover = pieceAt(src);
     PieceType destFormer = pieceAt(dest);
 
-    if (mover % 6 == 0 || destFormer != Empty) {
+    if (mover == Pawn || destFormer != Empty) {
       boardState[HAS_REPEATED_INDEX] = 0;
       boardState[HALFMOVE_INDEX] = 0;
+      stack.markIrreversible();
     } else {
       boardState[HALFMOVE_INDEX] += 1;
     }
@@ -641,15 +916,9 @@ void Board::makeMove(Move mv) {
     _removePiece(mover, src);
 
     if (moveType == MoveTypeCode::EnPassant) {
-      if (mover == W_Pawn) {
-        u64 capturedPawn = PAWN_MOVE_CACHE[u64ToIndex(dest)][Black];
-        _removePiece(B_Pawn, capturedPawn);
-        boardState[LAST_CAPTURED_INDEX] = B_Pawn;
-      } else {
-        u64 capturedPawn = PAWN_MOVE_CACHE[u64ToIndex(dest)][White];
-        _removePiece(W_Pawn, capturedPawn);
-        boardState[LAST_CAPTURED_INDEX] = W_Pawn;
-      }
+      u64 capturedPawn = PAWN_MOVE_CACHE[u64ToIndex(dest)][Them];
+      _removePiece(TheirPawn, capturedPawn);
+      boardState[LAST_CAPTURED_INDEX] = TheirPawn;
     } else if (destFormer != Empty) {
       _removePiece(destFormer, dest);
       boardState[LAST_CAPTURED_INDEX] = destFormer;
@@ -659,37 +928,24 @@ void Board::makeMove(Move mv) {
 
     // move to new location
     if (mv.isPromotion()) {
-      _addPiece(mv.getPromotingPiece(c), dest);
+      _addPiece(mv.getPromotingPiece(C), dest);
     } else {
       _addPiece(mover, dest);
     }
 
     if (moveType == MoveTypeCode::CastleLong) {
-      if (mover == W_King) {
-        _removePiece(W_Rook, rookStartingPositions[White][0]);
-        _addPiece(W_Rook, CASTLE_LONG_ROOK_DEST[White]);
-      } else {
-        _removePiece(B_Rook, rookStartingPositions[Black][0]);
-        _addPiece(B_Rook, CASTLE_LONG_ROOK_DEST[Black]);
-      }
+      _removePiece(Rook, rookStartingPositions[C][0]);
+      _addPiece(Rook, CASTLE_LONG_ROOK_DEST[C]);
     } else if (moveType == MoveTypeCode::CastleShort) {
-      if (mover == W_King) {
-        _removePiece(W_Rook, rookStartingPositions[White][1]);
-        _addPiece(W_Rook, CASTLE_SHORT_ROOK_DEST[White]);
-      } else {
-        _removePiece(B_Rook, rookStartingPositions[Black][1]);
-        _addPiece(B_Rook, CASTLE_SHORT_ROOK_DEST[Black]);
-      }
+      _removePiece(Rook, rookStartingPositions[C][1]);
+      _addPiece(Rook, CASTLE_SHORT_ROOK_DEST[C]);
     }
 
     // revoke castling rights
-    if (mover == W_King) {
-      _setCastlingPrivileges(White, 0, 0);
-    } else if (mover == B_King) {
-      _setCastlingPrivileges(Black, 0, 0);
+    if (mover == King) {
+      _setCastlingPrivileges(C, 0, 0);
     }
-    if ((mover == B_Rook || mover == W_Rook) ||
-        (destFormer == B_Rook || destFormer == W_Rook)) {
+    if (mover == Rook || destFormer == TheirRook) {
       u64 targets = src | dest;
       if (targets & rookStartingPositions[White][0]) {
         _setCastlingPrivileges(White, 0, boardState[W_SHORT_INDEX]);
@@ -708,20 +964,11 @@ void Board::makeMove(Move mv) {
     // handle en passant
     if (moveType == MoveTypeCode::DoublePawn) {
       // see if adjacent squares have pawns
-      if (mover == W_Pawn) {
-        int destIndex = u64ToIndex(dest);
-        if (bitboard[B_Pawn] & ONE_ADJACENT_CACHE[destIndex]) {
-          _setEpSquare(u64ToIndex(PAWN_MOVE_CACHE[destIndex][Black]));
-        } else {
-          _setEpSquare(-1);
-        }
+      int destIndex = u64ToIndex(dest);
+      if (bitboard[TheirPawn] & ONE_ADJACENT_CACHE[destIndex]) {
+        _setEpSquare(u64ToIndex(PAWN_MOVE_CACHE[destIndex][Them]));
       } else {
-        int destIndex = u64ToIndex(dest);
-        if (bitboard[W_Pawn] & ONE_ADJACENT_CACHE[destIndex]) {
-          _setEpSquare(u64ToIndex(PAWN_MOVE_CACHE[destIndex][White]));
-        } else {
-          _setEpSquare(-1);
-        }
+        _setEpSquare(-1);
       }
     } else {
       // all other moves: en passant square is nulled
@@ -729,70 +976,68 @@ void Board::makeMove(Move mv) {
     }
   } else {
     _setEpSquare(-1);
+    stack.markIrreversible(); // don't count repetitions across a null move
   }
 
-  _switchTurn();
+  _switchTurn(Them);
 
-  _generatePseudoLegal();
+  if (prefetch != nullptr) {
+    prefetch(zobrist());
+  }
 
-  if (!boardState[HAS_REPEATED_INDEX]) {
-    int counter = 0;
-    for (int i = stack.getIndex() - 2; i >= 0; i -= 2) {
-      BoardStateNode &node = stack.peekNodeAt(i);
-      if (node.hash == zobrist()) {
-        counter++;
-      }
-      if (node.data[LAST_MOVED_INDEX] % 6 == 0 ||
-          node.data[LAST_CAPTURED_INDEX] != Empty) {
-        break;
-      }
-    }
-    if (counter >= 2) {
+  _updatePseudoLegal(_changedSquares);
+
+  // a repeat needs at least four reversible plies
+  if (!boardState[HAS_REPEATED_INDEX] && boardState[HALFMOVE_INDEX] >= 4) {
+    if (stack.repetitions(zobrist()) >= 2) {
       boardState[HAS_REPEATED_INDEX] = 1;
     }
   }
 }
 
 void Board::unmakeMove() {
+  // the side that made the move is the one not on turn
+  if (turn() == White) {
+    _unmakeMove<Black>();
+  } else {
+    _unmakeMove<White>();
+  }
+}
+
+template <Color C> void Board::_unmakeMove() {
   // state changer
+  const Color Them = 1 - C;
+  const PieceType Rook = W_Rook + 6 * C;
+
+  _hasLegalityInfo = false;
+  _hasCheckInfo = false;
 
   BoardStateNode &node = stack.peek();
-  Move &mv = node.mv;
+  Move mv = node.mv;
+  int data[BOARD_STATE_ENTROPY];
+  node.unpack(data);
   int moveType = mv.getTypeCode();
+  _changedSquares = 0;
 
   if (moveType != MoveTypeCode::Null) {
     u64 src = mv.getSrc();
     u64 dest = mv.getDest();
-    int moveType = mv.getTypeCode();
     PieceType mover = boardState[LAST_MOVED_INDEX];
     PieceType destFormer = boardState[LAST_CAPTURED_INDEX];
 
-    if (moveType == MoveTypeCode::CastleLong ||
-        moveType == MoveTypeCode::CastleShort) {
-      if (mover == W_King) {
-        if (moveType == MoveTypeCode::CastleLong) {
-          _removePiece(W_Rook, CASTLE_LONG_ROOK_DEST[White]);
-          _addPiece(W_Rook, rookStartingPositions[White][0]);
-        } else {
-          _removePiece(W_Rook, CASTLE_SHORT_ROOK_DEST[White]);
-          _addPiece(W_Rook, rookStartingPositions[White][1]);
-        }
-      } else {
-        if (moveType == MoveTypeCode::CastleLong) {
-          _removePiece(B_Rook, CASTLE_LONG_ROOK_DEST[Black]);
-          _addPiece(B_Rook, rookStartingPositions[Black][0]);
-        } else {
-          _removePiece(B_Rook, CASTLE_SHORT_ROOK_DEST[Black]);
-          _addPiece(B_Rook, rookStartingPositions[Black][1]);
-        }
-      }
+    if (moveType == MoveTypeCode::CastleLong) {
+      _removePiece(Rook, CASTLE_LONG_ROOK_DEST[C]);
+      _addPiece(Rook, rookStartingPositions[C][0]);
+    } else if (moveType == MoveTypeCode::CastleShort) {
+      _removePiece(Rook, CASTLE_SHORT_ROOK_DEST[C]);
+      _addPiece(Rook, rookStartingPositions[C][1]);
     }
 
     // move piece to old src
     _addPiece(mover, src);
 
     if (mv.isPromotion()) {
-      _removePiece(mv.getPromotingPiece(flipColor(turn())), dest);
+      _removePiece(mv.getPromotingPiece(C), dest);
     } else {
       _removePiece(mover, dest);
     }
@@ -801,36 +1046,26 @@ void Board::unmakeMove() {
     if (moveType ==
         MoveTypeCode::EnPassant) { // instead of restoring at capture
                                    // location, restore one above
-      if (mover == W_Pawn) {
-        _addPiece(B_Pawn, PAWN_MOVE_CACHE[u64ToIndex(dest)][Black]);
-      } else {
-        _addPiece(W_Pawn, PAWN_MOVE_CACHE[u64ToIndex(dest)][White]);
-      }
+      _addPiece(W_Pawn + 6 * Them, PAWN_MOVE_CACHE[u64ToIndex(dest)][Them]);
     } else if (destFormer != Empty) {
       _addPiece(destFormer, dest); // restore to capture location
     }
   }
 
-  _switchTurn(node.data[TURN_INDEX]);
-  _setEpSquare(node.data[EN_PASSANT_INDEX]);
-  _setCastlingPrivileges(White, node.data[W_LONG_INDEX],
-                         node.data[W_SHORT_INDEX]);
-  _setCastlingPrivileges(Black, node.data[B_LONG_INDEX],
-                         node.data[B_SHORT_INDEX]);
-  boardState[LAST_MOVED_INDEX] = node.data[LAST_MOVED_INDEX];
-  boardState[LAST_CAPTURED_INDEX] = node.data[LAST_CAPTURED_INDEX];
-  boardState[HAS_REPEATED_INDEX] = node.data[HAS_REPEATED_INDEX];
-  boardState[HALFMOVE_INDEX] = node.data[HALFMOVE_INDEX];
+  _switchTurn(data[TURN_INDEX]);
+  _setEpSquare(data[EN_PASSANT_INDEX]);
+  _setCastlingPrivileges(White, data[W_LONG_INDEX], data[W_SHORT_INDEX]);
+  _setCastlingPrivileges(Black, data[B_LONG_INDEX], data[B_SHORT_INDEX]);
+  boardState[LAST_MOVED_INDEX] = data[LAST_MOVED_INDEX];
+  boardState[LAST_CAPTURED_INDEX] = data[LAST_CAPTURED_INDEX];
+  boardState[HAS_REPEATED_INDEX] = data[HAS_REPEATED_INDEX];
+  boardState[HALFMOVE_INDEX] = data[HALFMOVE_INDEX];
 
   _status = BoardStatus::Playing; // do we ever go past?
 
   stack.pop();
 
-  _pseudoStack.pop_back(); // pop current
-
-  PseudoLegalData pdata = _pseudoStack.back(); // obtain old
-  attackMap = pdata.aMap;
-  defendMap = pdata.dMap;
+  _updatePseudoLegal(_changedSquares);
 }
 
 void Board::_setCastlingPrivileges(Color color, int cLong, int cShort) {
@@ -873,14 +1108,14 @@ void Board::_setEpSquare(int sq) {
   if (currentSq != -1) {
     // there is an en passant square already
     // we want to remove it
-    int currentRow = u64ToRow(currentSq);
-    u64 hash = ZOBRIST_HASHES[EP_HASH_POS + currentRow];
+    int currentCol = intToCol(currentSq);
+    u64 hash = ZOBRIST_HASHES[EP_HASH_POS + currentCol];
     _zobristHash ^= hash;
   }
   if (sq != -1) {
     // we are adding a new one
-    int newRow = u64ToRow(sq);
-    u64 hash = ZOBRIST_HASHES[EP_HASH_POS + newRow];
+    int newCol = intToCol(sq);
+    u64 hash = ZOBRIST_HASHES[EP_HASH_POS + newCol];
     _zobristHash ^= hash;
   }
   boardState[EN_PASSANT_INDEX] = sq;
@@ -997,9 +1232,9 @@ void Board::dump(bool debug) {
     /*std::cout << "\nState stack: ";
     for (int i = 0; i < (int)stack.getIndex(); i++) {
       auto node = stack.peekNodeAt(i);
-      std::cout << "(" << (int)node.data[LAST_MOVED_INDEX] << ",";
-      std::cout << (int)node.data[LAST_CAPTURED_INDEX] << ") ";
-      std::cout << (int)node.data[EN_PASSANT_INDEX] << ") ";
+      std::cout << "(" << (int)node.lastMoved << ",";
+      std::cout << (int)node.lastCaptured << ") ";
+      std::cout << (int)node.epSquare << ") ";
     }*/
     std::cout << "\n" << fen();
     std::cout << "\n";
@@ -1016,136 +1251,18 @@ void Board::dump(bool debug) {
   }
 }
 
-void Board::generateSpecialMoves(SpecialMoveBuffer &sbuffer) {
-  // fill specialbuffer
-  // pawn moves: en passant and double moves
-  // castles
-  Color color = turn();
-  u64 enemies = occupancy(flipColor(color));
-  u64 friendlies = occupancy(color);
-  u64 occ = enemies | friendlies;
-
-  PieceType pawn = color == White ? W_Pawn : B_Pawn;
-  int sRow = color == White ? 1 : 6;
-  int pRow = color == White ? 6 : 1;
-
-  std::array<int, 64> arr;
-  int count;
-  bitscanAllInt(arr, bitboard[pawn], count);
-  for (int i = 0; i < count; i++) {
-    int srci = arr[i];
-    int row = intToRow(srci);
-    if (boardState[EN_PASSANT_INDEX] >= 0 &&
-        u64FromIndex(boardState[EN_PASSANT_INDEX]) & attackMap[srci]) {
-      sbuffer.push_back(
-          Move(srci, boardState[EN_PASSANT_INDEX], MoveTypeCode::EnPassant));
-    }
-    u64 singleMove = PAWN_MOVE_CACHE[srci][color] & ~occ;
-    if (singleMove) {
-      if (row == sRow) {
-        u64 doubleMove = PAWN_DOUBLE_CACHE[srci][color] & ~occ;
-        if (doubleMove) {
-          sbuffer.push_back(
-              Move(srci, u64ToIndex(doubleMove), MoveTypeCode::DoublePawn));
-        }
-      }
-      if (row == pRow) {
-        int desti = u64ToIndex(singleMove);
-        sbuffer.push_back(Move(srci, desti, MoveTypeCode::BPromotion));
-        sbuffer.push_back(Move(srci, desti, MoveTypeCode::RPromotion));
-        sbuffer.push_back(Move(srci, desti, MoveTypeCode::KPromotion));
-        sbuffer.push_back(Move(srci, desti, MoveTypeCode::QPromotion));
-      } else {
-        sbuffer.push_back(
-            Move(srci, u64ToIndex(singleMove), MoveTypeCode::Default));
-      }
-    }
-  }
-
-  if (!isCheck()) {
-    PieceType myKing = color == White ? W_King : B_King;
-    int myKingIndex = u64ToIndex(bitboard[myKing]);
-    size_t myLongIndex = B_LONG_INDEX;
-    size_t myShortIndex = B_SHORT_INDEX;
-    if (myKing == W_King) {
-      myLongIndex = W_LONG_INDEX;
-      myShortIndex = W_SHORT_INDEX;
-    }
-    Color opponent = flipColor(color);
-    if (boardState[myLongIndex]) {               // is allowed
-      if (!(CASTLE_LONG_SQUARES[color] & occ)) { // in-between is empty
-        if (!_isUnderAttack(CASTLE_LONG_KING_SLIDE[color], opponent)) {
-          sbuffer.push_back(Move(myKingIndex,
-                                 u64ToIndex(CASTLE_LONG_KING_DEST[color]),
-                                 MoveTypeCode::CastleLong));
-        }
-      }
-    }
-    if (boardState[myShortIndex]) {               // is allowed
-      if (!(CASTLE_SHORT_SQUARES[color] & occ)) { // in-between is empty
-        if (!_isUnderAttack(CASTLE_SHORT_KING_SLIDE[color], opponent)) {
-          sbuffer.push_back(Move(myKingIndex,
-                                 u64ToIndex(CASTLE_SHORT_KING_DEST[color]),
-                                 MoveTypeCode::CastleShort));
-        }
-      }
-    }
-  }
-}
-
-Move Board::nextMove(LazyMovegen &movegen) {
-  if (movegen.hasNext()) {
-    int s, d;
-    movegen.next(attackMap, s, d);
-    // std::cout << s << "->" << d <<"\n";
-    u64 friendlies = occupancy(turn());
-    if (u64FromIndex(d) & friendlies) {
-      return nextMove(movegen);
-    } else {
-      Move mv;
-      Color color = turn();
-      PieceType pawn = color == White ? W_Pawn : B_Pawn;
-      int pRow = color == White ? 6 : 1;
-      if (u64FromIndex(s) & bitboard[pawn]) {
-        u64 enemies = occupancy(flipColor(color));
-        // deal with pawn capture rules
-        if (u64FromIndex(d) & enemies) {
-          if (intToRow(s) == pRow) {
-            movegen.sbuffer.push_back(Move(s, d, MoveTypeCode::BPromotion));
-            movegen.sbuffer.push_back(Move(s, d, MoveTypeCode::RPromotion));
-            movegen.sbuffer.push_back(Move(s, d, MoveTypeCode::KPromotion));
-            movegen.sbuffer.push_back(Move(s, d, MoveTypeCode::QPromotion));
-            return nextMove(movegen);
-          } else {
-            mv = Move(s, d, MoveTypeCode::Default);
-          }
-        } else {
-          return nextMove(movegen);
-        }
-      } else {
-        mv = Move(s, d, MoveTypeCode::Default);
-      }
-      if (_verifyLegal(mv)) {
-        return mv;
-      } else {
-        return nextMove(movegen);
-      }
-    }
-  } else {
-    if (!movegen.hasGenSpecial) {
-      generateSpecialMoves(movegen.sbuffer);
-      movegen.hasGenSpecial = true;
-    }
-    while (movegen.sbuffer.size() > 0) {
-      Move mv = movegen.sbuffer.back();
-      movegen.sbuffer.pop_back();
-      if (_verifyLegal(mv)) {
-        return mv;
-      }
-    }
-    // no more
-    return Move(); // null ends the iterator;
-  }
+template <Color C> bool Board::_canCastle(bool isLong) {
+  // assumes C is not in check
+  const Color Them = 1 - C;
+  u64 occ = occupancy();
+  if (isLong) {
+    return boardState[C == White ? W_LONG_INDEX : B_LONG_INDEX] &&
+           !(CASTLE_LONG_SQUARES[C] & occ) && // in-between is empty
+           !_isUnderAttack(CASTLE_LONG_KING_SLIDE[C], Them);
+  }
+  return boardState[C == White ? W_SHORT_INDEX : B_SHORT_INDEX] &&
+         !(CASTLE_SHORT_SQUARES[C] & occ) &&
+         !_isUnderAttack(CASTLE_SHORT_KING_SLIDE[C], Them);
 }
 
 Move Board::lastMove() {
@@ -1232,93 +1349,13 @@ u64 Board::_bishopRay(u64 origin, int direction, u64 mask) {
 }
 
 u64 Board::_rookAttacks(u64 index64, u64 occupants) {
-  // given a color rook at index64
-  int index = u64ToIndex(index64);
-  u64 ray = 0;
-  u64 overlaps = 0;
-  u64 result = 0;
-
-  ray = ROOK_MOVE_CACHE[index][0];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~ROOK_MOVE_CACHE[bitscanForward(overlaps)][0];
-  }
-
-  ray = ROOK_MOVE_CACHE[index][1];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~ROOK_MOVE_CACHE[bitscanForward(overlaps)][1];
-  }
-
-  ray = ROOK_MOVE_CACHE[index][2];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~ROOK_MOVE_CACHE[bitscanReverse(overlaps)][2];
-  }
-
-  ray = ROOK_MOVE_CACHE[index][3];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~ROOK_MOVE_CACHE[bitscanReverse(overlaps)][3];
-  }
-
-  return result;
-}
+  return rookAttacks(u64ToIndex(index64), occupants);
+}
 
 u64 Board::_bishopAttacks(u64 index64, u64 occupants) {
-  // given a color bishop at index64
-  int index = u64ToIndex(index64);
-  u64 ray = 0;
-  u64 result = 0;
-  u64 overlaps = 0;
-
-  ray = BISHOP_MOVE_CACHE[index][0];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~BISHOP_MOVE_CACHE[bitscanForward(overlaps)][0];
-  }
-
-  ray = BISHOP_MOVE_CACHE[index][1];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~BISHOP_MOVE_CACHE[bitscanForward(overlaps)][1];
-  }
-
-  ray = BISHOP_MOVE_CACHE[index][2];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~BISHOP_MOVE_CACHE[bitscanReverse(overlaps)][2];
-  }
-
-  ray = BISHOP_MOVE_CACHE[index][3];
-  overlaps = ray & occupants;
-  result |= ray;
-  if (overlaps) {
-    result &= ~BISHOP_MOVE_CACHE[bitscanReverse(overlaps)][3];
-  }
-  return result;
+  return bishopAttacks(u64ToIndex(index64), occupants);
 }
 
-u64 Board::occupancy(Color color) {
-  // cache this?
-  if (color == White) {
-    return bitboard[W_King] | bitboard[W_Queen] | bitboard[W_Knight] |
-           bitboard[W_Bishop] | bitboard[W_Rook] | bitboard[W_Pawn];
-  } else {
-    return bitboard[B_King] | bitboard[B_Queen] | bitboard[B_Knight] |
-           bitboard[B_Bishop] | bitboard[B_Rook] | bitboard[B_Pawn];
-  }
-}
-
-u64 Board::occupancy() { return occupancy(White) | occupancy(Black); }
-
 PieceType
 Board::_leastValuablePiece(u64 sqset, Color color,
                            u64 &outposition) { // returns the least valuable
@@ -1335,9 +1372,45 @@ Board::_leastValuablePiece(u64 sqset, Color color,
   return Empty;
 }
 
+u64 Board::_attackersTo(int index, u64 occupants) {
+  // pieces of both colors attacking index, sliders seen through occupants
+  u64 rooks = bitboard[W_Rook] | bitboard[B_Rook] | bitboard[W_Queen] |
+              bitboard[B_Queen];
+  u64 bishops = bitboard[W_Bishop] | bitboard[B_Bishop] | bitboard[W_Queen] |
+                bitboard[B_Queen];
+  return (PAWN_CAPTURE_CACHE[index][Black] & bitboard[W_Pawn]) |
+         (PAWN_CAPTURE_CACHE[index][White] & bitboard[B_Pawn]) |
+         (KNIGHT_MOVE_CACHE[index] &
+          (bitboard[W_Knight] | bitboard[B_Knight])) |
+         (KING_MOVE_CACHE[index] & (bitboard[W_King] | bitboard[B_King])) |
+         (rookAttacks(index, occupants) & rooks) |
+         (bishopAttacks(index, occupants) & bishops);
+}
+
+u64 Board::_xrayAttackersTo(int index, u64 occupants, PieceType vacated) {
+  // sliders uncovered on the line through the square vacated by a piece of
+  // type vacated; knights never stand on a line through index
+  PieceType type = vacated % 6;
+  u64 result = 0;
+  if (type == W_Pawn || type == W_Bishop || type == W_Queen ||
+      type == W_King) {
+    result |= bishopAttacks(index, occupants) &
+              (bitboard[W_Bishop] | bitboard[B_Bishop] | bitboard[W_Queen] |
+               bitboard[B_Queen]);
+  }
+  if (type == W_Rook || type == W_Queen || type == W_King) {
+    result |= rookAttacks(index, occupants) &
+              (bitboard[W_Rook] | bitboard[B_Rook] | bitboard[W_Queen] |
+               bitboard[B_Queen]);
+  }
+  return result & occupants;
+}
+
 int Board::see(Move mv) {
+  // static exch eval for move ordering and quiescience pruning
   u64 src = mv.getSrc();
   u64 dest = mv.getDest();
+  int destIndex = mv.getDestIndex();
   PieceType attacker = pieceAt(src);
   PieceType targetPiece = pieceAt(dest);
 
@@ -1345,104 +1418,75 @@ int Board::see(Move mv) {
     return -1;
 
   Color color = colorOf(attacker);
-  u64 attackSet = _isUnderAttack(dest);
-  u64 usedAttackers = src;
-  u64 occ = occupancy() & ~src; //"move" from src
+  u64 occ = occupancy();
+  u64 attackSet = _attackersTo(destIndex, occ);
+  u64 attPos = src;
 
   int scores[32];
   int depth = 0;
   scores[0] = MATERIAL_TABLE[targetPiece]; // first player is up by capturing
-  color = flipColor(color);
-  // std::cout << "\nscores[" << depth << "] = " << scores[depth] << "\n";
-  PieceType piece = attacker; // piece at dest
-
-  std::array<u64, 64> arr;
-  int count;
+  PieceType piece = attacker;              // piece at dest
 
   do {
     depth++;
     scores[depth] = MATERIAL_TABLE[piece] - scores[depth - 1]; // capture!
-    // std::cout << "\npiece = " << pieceToString(piece) << "\n";
-    // std::cout << "scores[" << depth << "] = " << scores[depth] << "\n";
-
-    if (max(-1 * scores[depth - 1], scores[depth]) < 0)
-      break;
 
-    // add x-ray or conditional attackers to attack set
-    // add pawns
-    bitscanAll(arr, bitboard[W_Pawn], count);
-    for (int i = 0; i < count; i++) {
-      u64 loc = arr[i];
-      if ((loc & usedAttackers) == 0) {
-        if (PAWN_CAPTURE_CACHE[u64ToIndex(loc)][White] & dest) {
-          attackSet |= loc;
-        }
-      }
-    }
-    bitscanAll(arr, bitboard[B_Pawn], count);
-    for (int i = 0; i < count; i++) {
-      u64 loc = arr[i];
-      if ((loc & usedAttackers) == 0) {
-        if (PAWN_CAPTURE_CACHE[u64ToIndex(loc)][Black] & dest) {
-          attackSet |= loc;
-        }
-      }
-    }
-    bitscanAll(arr, bitboard[W_Rook] | bitboard[B_Rook], count);
-    for (int i = 0; i < count; i++) {
-      u64 loc = arr[i];
-      if ((loc & usedAttackers) == 0) {
-        for (int d = 0; d < 4; d++) {
-          if (_rookRay(loc, d, occ) & dest) {
-            attackSet |= loc;
-          }
-        }
-      }
-    }
-    bitscanAll(arr, bitboard[W_Bishop] | bitboard[B_Bishop], count);
-    for (int i = 0; i < count; i++) {
-      u64 loc = arr[i];
-      if ((loc & usedAttackers) == 0) {
-        for (int d = 0; d < 4; d++) {
-          if (_bishopRay(loc, d, occ) & dest) {
-            attackSet |= loc;
-          }
-        }
-      }
-    }
-    bitscanAll(arr, bitboard[W_Queen] | bitboard[B_Queen], count);
-    for (int i = 0; i < count; i++) {
-      u64 loc = arr[i];
-      if ((loc & usedAttackers) == 0) {
-        for (int d = 0; d < 4; d++) {
-          if (_bishopRay(loc, d, occ) & dest) {
-            attackSet |= loc;
-          }
-          if (_rookRay(loc, d, occ) & dest) {
-            attackSet |= loc;
-          }
-        }
-      }
-    }
-
-    u64 attPos = 0;
-    attackSet = attackSet & ~usedAttackers; // remove attacker from attack set
-
-    piece = _leastValuablePiece(attackSet, color, attPos);
-    usedAttackers |= attPos;
+    // the capturer leaves its square, which may uncover a slider behind it
     occ &= ~attPos;
+    attackSet = (attackSet & occ) | _xrayAttackersTo(destIndex, occ, piece);
+
     color = flipColor(color);
-  } while (piece != Empty);
+    piece = _leastValuablePiece(attackSet, color, attPos);
+  } while (piece != Empty && depth < 31);
   while (--depth) {
     scores[depth - 1] = -1 * max(-1 * scores[depth - 1], scores[depth]);
   }
   return scores[0];
-  // static exch eval for move ordering and quiescience pruning
 }
 
-bool Board::_isInLineWithKing(u64 square, Color kingColor, u64 kingBB) {
-  u64 outRay = 0;
-  return _isInLineWithKing(square, kingColor, kingBB, outRay);
+bool Board::seeGE(Move mv, int threshold) {
+  // same answer as see(mv) >= threshold, but only follows the exchange until
+  // one side can't change the outcome any more
+  u64 src = mv.getSrc();
+  u64 dest = mv.getDest();
+  int destIndex = mv.getDestIndex();
+  PieceType attacker = pieceAt(src);
+  PieceType targetPiece = pieceAt(dest);
+
+  if (targetPiece == Empty)
+    return -1 >= threshold;
+
+  // swap is what the side that just captured stands to lose next
+  int swap = MATERIAL_TABLE[targetPiece] - threshold;
+  if (swap < 0)
+    return false; // even keeping the capture falls short
+  swap = MATERIAL_TABLE[attacker] - swap;
+  if (swap <= 0)
+    return true; // even losing the capturer stays above threshold
+
+  Color color = colorOf(attacker);
+  u64 occ = occupancy() & ~src & ~dest;
+  u64 attackSet = _attackersTo(destIndex, occ);
+  bool result = true;
+  while (true) {
+    color = flipColor(color);
+    attackSet &= occ;
+    u64 attPos = 0;
+    PieceType piece = _leastValuablePiece(attackSet, color, attPos);
+    if (piece == Empty)
+      break;
+    result = !result;
+    if (piece % 6 == W_King) {
+      // the king can only take last
+      return (attackSet & occupancy(flipColor(color))) ? !result : result;
+    }
+    swap = MATERIAL_TABLE[piece] - swap;
+    if (swap < (int)result)
+      break;
+    occ &= ~attPos;
+    attackSet |= _xrayAttackersTo(destIndex, occ, piece);
+  }
+  return result;
 }
 
 bool Board::_isInLineWithKing(u64 square, Color kingColor, u64 kingBB,
@@ -1479,21 +1523,35 @@ bool Board::_isInLineWithKing(u64 square, Color kingColor, u64 kingBB,
 }
 
 MoveVector<256> Board::produceUncheckMoves() {
-  // todo make this work
   MoveVector<256> v;
+  generateEvasions(v);
+  return v;
+}
 
-  Color color = turn();
-  Color enemyColor = flipColor(color);
-  PieceType king = W_King + turn() * 6;
-  u64 attackerPositions = _isUnderAttack(bitboard[king], enemyColor);
+void Board::generateEvasions(MoveVector<256> &moves) {
+  if (turn() == White) {
+    _generateEvasions<White>(moves);
+  } else {
+    _generateEvasions<Black>(moves);
+  }
+}
+
+template <Color C> void Board::_generateEvasions(MoveVector<256> &v) {
+  const Color color = C;
+  const Color enemyColor = 1 - C;
+  const PieceType king = W_King + 6 * C;
+  if (!_hasLegalityInfo) {
+    _computeLegalityInfo();
+  }
+  u64 attackerPositions = _checkers;
   int checkCount = hadd(attackerPositions);
   std::array<u64, 64> arr;
   int count;
-  int pRow0 = color == White ? 7 : 0;
-  int pRow = color == White ? 6 : 1;
-  int sRow = color == White ? 1 : 6;
-  u64 myOcc = occupancy(color);
-  u64 enemyOcc = occupancy(enemyColor);
+  const int pRow0 = C == White ? 7 : 0;
+  const int pRow = C == White ? 6 : 1;
+  const int sRow = C == White ? 1 : 6;
+  u64 myOcc = _colorOccupancy[C];
+  u64 enemyOcc = _colorOccupancy[enemyColor];
   u64 occ = myOcc | enemyOcc;
 
   if (checkCount == 1) {
@@ -1531,6 +1589,23 @@ MoveVector<256> Board::produceUncheckMoves() {
 
     std::array<u64, 64> arr0;
     int count0;
+    // en passant either takes the checking pawn or lands on the block ray
+    int epIndex = boardState[EN_PASSANT_INDEX];
+    if (epIndex >= 0) {
+      u64 capturedPawn = PAWN_MOVE_CACHE[epIndex][enemyColor];
+      if ((capturedPawn & attackerPositions) ||
+          (u64FromIndex(epIndex) & targetLocations)) {
+        u64 pawns = bitboard[W_Pawn + color * 6] & defendMap[epIndex];
+        while (pawns) {
+          Move mv(bitscanForward(pawns), epIndex, MoveTypeCode::EnPassant);
+          pawns &= pawns - 1;
+          if (_verifyLegal<C>(mv)) {
+            v.push_back(mv);
+          }
+        }
+      }
+    }
+
     bitscanAll(arr0, targetLocations, count0);
     for (int k = 0; k < count0;
          k++) { // loop over each uncheck destination (capture or block)
@@ -1542,7 +1617,7 @@ MoveVector<256> Board::produceUncheckMoves() {
         if (arr[i] & kingBB)
           continue;
         int srci = u64ToIndex(arr[i]);
-        if (!_isInLineWithKing(arr[i], color, kingBB)) {
+        if (!(arr[i] & _pinned)) {
           // check for promotions or en passant
           PieceType mover = pieceAt(arr[i]);
           if (mover % 6 == W_Pawn) { // if pawn we need to ensure is capture
@@ -1571,24 +1646,10 @@ MoveVector<256> Board::produceUncheckMoves() {
         bitscanAllInt(arr, bitboard[W_Pawn + color * 6], count);
         for (int i = 0; i < count; i++) { // go thru each pawn
           int srci = arr[i];
-          int src = u64FromIndex(arr[i]);
-          if (_isInLineWithKing(src, color, kingBB))
+          u64 src = u64FromIndex(arr[i]);
+          if (src & _pinned)
             continue; // if the pawn is pinned skip
 
-          // handle the rare en passant uncheck here
-          // both must not be pinned (capturer and captured)
-          if (boardState[EN_PASSANT_INDEX] >= 0 &&
-              u64FromIndex(boardState[EN_PASSANT_INDEX]) & attackMap[srci]) {
-            u64 capturedPawn = PAWN_MOVE_CACHE[targetIndex][enemyColor];
-            if (!_isInLineWithKing(src | capturedPawn, color, kingBB)) {
-              // both are not pinned
-              if (capturedPawn & target) {
-                v.push_back(Move(srci, boardState[EN_PASSANT_INDEX],
-                                 MoveTypeCode::EnPassant));
-              }
-            }
-          }
-
           int row = intToRow(srci);
           u64 singleMove = PAWN_MOVE_CACHE[srci][color] & ~occ;
           if (singleMove) {
@@ -1628,39 +1689,45 @@ MoveVector<256> Board::produceUncheckMoves() {
       v.push_back(Move(kingIndex, u64ToIndex(arr[i]), MoveTypeCode::Default));
     }
   }
-  return v;
 }
 
-bool Board::_verifyLegal(Move mv) {
+template <Color C> bool Board::_verifyLegal(Move mv) {
   // assumes not already in check
   // if we were in check, then a lot of illegal moves would be included
   if (mv.getTypeCode() == MoveTypeCode::CastleLong ||
       mv.getTypeCode() == MoveTypeCode::CastleShort) {
     return true; // castling is verified by default
   }
-  Color c = turn();
-  Color enemyColor = flipColor(c);
+  const Color c = C;
+  const Color enemyColor = 1 - C;
   u64 src = mv.getSrc();
   u64 dest = mv.getDest();
   if (mv.getTypeCode() == MoveTypeCode::EnPassant) {
+    // two pawns leave the board at once, so test the sliders on the
+    // resulting occupancy rather than the pin masks
     int destIndex = u64ToIndex(dest);
-    u64 capturedPawn = PAWN_MOVE_CACHE[destIndex][flipColor(c)];
-    if (_isInLineWithKing(src | capturedPawn, c, bitboard[W_King + 6 * c])) {
-      return false;
-    }
-    return true;
-  }
-  PieceType mover = pieceAt(src);
-  if (mover % 6 == W_King) {
+    u64 capturedPawn = PAWN_MOVE_CACHE[destIndex][enemyColor];
+    u64 occ = (occupancy() & ~(src | capturedPawn)) | dest;
+    int kingIndex = u64ToIndex(bitboard[W_King + 6 * c]);
+    u64 rooks = bitboard[W_Rook + 6 * enemyColor] |
+                bitboard[W_Queen + 6 * enemyColor];
+    u64 bishops = bitboard[W_Bishop + 6 * enemyColor] |
+                  bitboard[W_Queen + 6 * enemyColor];
+    return !(rookAttacks(kingIndex, occ) & rooks) &&
+           !(bishopAttacks(kingIndex, occ) & bishops);
+  }
+  if (src & bitboard[W_King + 6 * C]) {
     // can't move into a controlled square
     // place a "king" onto dest
     return _isUnderAttack(dest, enemyColor) ? false : true;
   }
-  u64 outRay;
-  if (_isInLineWithKing(src, c, bitboard[W_King + 6 * c], outRay)) {
+  if (!_hasLegalityInfo) {
+    _computeLegalityInfo();
+  }
+  if (src & _pinned) {
     // can capture the piece that is pinning it
     // or move along pinned path
-    return (dest & outRay) ? true : false;
+    return (dest & _pinRay[mv.getSrcIndex()]) ? true : false;
   }
   return true;
 }
@@ -1697,83 +1764,265 @@ bool Board::isCheckingMove(Move mv) {
                ? true
                : false; // set to bool so we can compare output
   } else if (mv.getTypeCode() == MoveTypeCode::EnPassant) {
+    // two squares empty and one fills, so look from the king through the
+    // occupancy after the capture for a slider of ours
     u64 src = mv.getSrc();
     u64 dest = mv.getDest();
     int destIndex = u64ToIndex(dest);
     u64 capturedPawn = PAWN_MOVE_CACHE[destIndex][enemyColor];
-    if (_isInLineWithKing(src | capturedPawn, enemyColor, bitboard[king])) {
+    u64 occ = (occupancy() ^ src ^ capturedPawn) | dest;
+    int kingIndex = u64ToIndex(bitboard[king]);
+    u64 queens = bitboard[W_Queen + 6 * moveColor];
+    u64 rooks = bitboard[W_Rook + 6 * moveColor] | queens;
+    u64 bishops = bitboard[W_Bishop + 6 * moveColor] | queens;
+    if ((rookAttacks(kingIndex, occ) & rooks) ||
+        (bishopAttacks(kingIndex, occ) & bishops)) {
       return true;
     }
     return PAWN_CAPTURE_CACHE[destIndex][moveColor] & bitboard[king] ? true
                                                                      : false;
+  }
+
+  if (!_hasCheckInfo) {
+    _computeCheckInfo();
+  }
+  u64 src = mv.getSrc();
+  u64 dest = mv.getDest();
+
+  // moving a discoverer off its line uncovers the slider behind it
+  if ((src & _discoverers) && !(dest & _discoverRay[mv.getSrcIndex()])) {
+    return true;
+  }
+
+  if (!mv.isPromotion()) {
+    return (dest & _checkSquares[pieceAt(src) % 6]) ? true : false;
+  }
+
+  // the promoted piece may see the king through the square it left
+  u64 occ = occupancy() & ~src;
+  u64 kingBB = bitboard[king];
+  int destIndex = mv.getDestIndex();
+  switch (mv.getPromotingPiece()) {
+  case W_Knight:
+    return (dest & _checkSquares[W_Knight]) ? true : false;
+  case W_Bishop:
+    return bishopAttacks(destIndex, occ) & kingBB ? true : false;
+  case W_Rook:
+    return rookAttacks(destIndex, occ) & kingBB ? true : false;
+  case W_Queen:
+    return (bishopAttacks(destIndex, occ) | rookAttacks(destIndex, occ)) &
+                   kingBB
+               ? true
+               : false;
+  }
+  return false;
+}
+
+MoveVector<256> Board::legalMoves() {
+  MoveVector<256> v;
+  if (isCheck()) {
+    generateEvasions(v);
   } else {
-    u64 src = mv.getSrc();
-    u64 dest = mv.getDest();
-    PieceType mover = pieceAt(src);
+    generateCaptures(v);
+    generateQuiets(v);
+  }
+  return v;
+}
+
+void Board::generateCaptures(MoveVector<256> &moves) {
+  if (turn() == White) {
+    _generateCaptures<White>(moves, _colorOccupancy[White]);
+  } else {
+    _generateCaptures<Black>(moves, _colorOccupancy[Black]);
+  }
+}
+
+void Board::generateQuiets(MoveVector<256> &moves) {
+  if (turn() == White) {
+    _generateQuiets<White>(moves, _colorOccupancy[White]);
+  } else {
+    _generateQuiets<Black>(moves, _colorOccupancy[Black]);
+  }
+}
 
-    u64 outRay;
-    // check for discoveries
-    if (_isInLineWithKing(src, enemyColor, bitboard[king], outRay)) {
-      return (dest & outRay) ? false : true;
+void Board::generateQuietChecks(MoveVector<256> &moves) {
+  MoveVector<256> quiets;
+  generateQuiets(quiets);
+  for (int i = 0; i < quiets.size(); i++) {
+    if (isCheckingMove(quiets[i])) {
+      moves.push_back(quiets[i]);
     }
+  }
+}
 
-    // the mover color can attack the king. check for attacks based
-    // on piece type
-    u64 occ = occupancy();
-    u64 kingBB = bitboard[king];
-    PieceType pieceKind = mover % 6;
-    if (mv.isPromotion()) {
-      pieceKind = mv.getPromotingPiece();
+bool Board::isLegalMove(Move mv) {
+  if (mv.isNull()) {
+    return false;
+  }
+  MoveVector<256> v;
+  if (isCheck()) {
+    generateEvasions(v);
+  } else {
+    u64 src = mv.getSrc();
+    if (!(src & occupancy(turn()))) {
+      return false;
     }
-    u64 pieceMap = dest | (occ & ~src);
-    int destIndex = u64ToIndex(dest);
-    switch (pieceKind) {
-    case W_Pawn:
-      return PAWN_CAPTURE_CACHE[destIndex][moveColor] & kingBB ? true : false;
-    case W_Knight:
-      return KNIGHT_MOVE_CACHE[destIndex] & kingBB ? true : false;
-    case W_Bishop:
-      for (int d = 0; d < 4; d++) {
-        u64 ray = _bishopRay(dest, d, pieceMap);
-        if (ray & kingBB) {
-          return true;
-        }
+    if (turn() == White) {
+      _generateCaptures<White>(v, src);
+      _generateQuiets<White>(v, src);
+    } else {
+      _generateCaptures<Black>(v, src);
+      _generateQuiets<Black>(v, src);
+    }
+  }
+  for (int i = 0; i < v.size(); i++) {
+    if (v[i] == mv) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <Color C>
+void Board::_generateCaptures(MoveVector<256> &moves, u64 from) {
+  // captures, en passant and all promotions of pieces in from
+  // assumes not in check
+  const Color color = C;
+  const int pRow = C == White ? 6 : 1;
+  u64 enemies = _colorOccupancy[1 - C];
+  u64 occ = occupancy();
+  u64 pawns = bitboard[W_Pawn + 6 * C] & from;
+  u64 pieces = from & ~pawns;
+
+  while (pieces) {
+    int s = bitscanForward(pieces);
+    pieces &= pieces - 1;
+    u64 targets = attackMap[s] & enemies;
+    while (targets) {
+      int d = bitscanForward(targets);
+      targets &= targets - 1;
+      Move mv(s, d, MoveTypeCode::Default);
+      if (_verifyLegal<C>(mv)) {
+        moves.push_back(mv);
       }
-      break;
-    case W_Rook:
-      for (int d = 0; d < 4; d++) {
-        u64 ray = _rookRay(dest, d, pieceMap);
-        if (ray & kingBB) {
-          return true;
+    }
+  }
+
+  while (pawns) {
+    int s = bitscanForward(pawns);
+    pawns &= pawns - 1;
+    bool promotes = intToRow(s) == pRow;
+    u64 targets = attackMap[s] & enemies;
+    if (promotes) {
+      targets |= PAWN_MOVE_CACHE[s][color] & ~occ;
+    }
+    while (targets) {
+      int d = bitscanForward(targets);
+      targets &= targets - 1;
+      if (promotes) {
+        if (_verifyLegal<C>(Move(s, d, MoveTypeCode::QPromotion))) {
+          moves.push_back(Move(s, d, MoveTypeCode::QPromotion));
+          moves.push_back(Move(s, d, MoveTypeCode::RPromotion));
+          moves.push_back(Move(s, d, MoveTypeCode::BPromotion));
+          moves.push_back(Move(s, d, MoveTypeCode::KPromotion));
         }
-      }
-      break;
-    case W_Queen:
-      for (int d = 0; d < 4; d++) {
-        u64 ray = _rookRay(dest, d, pieceMap) | _bishopRay(dest, d, pieceMap);
-        if (ray & kingBB) {
-          return true;
+      } else {
+        Move mv(s, d, MoveTypeCode::Default);
+        if (_verifyLegal<C>(mv)) {
+          moves.push_back(mv);
         }
       }
-      break;
+    }
+    int epIndex = boardState[EN_PASSANT_INDEX];
+    if (epIndex >= 0 && (u64FromIndex(epIndex) & attackMap[s])) {
+      Move mv(s, epIndex, MoveTypeCode::EnPassant);
+      if (_verifyLegal<C>(mv)) {
+        moves.push_back(mv);
+      }
     }
   }
-  return false;
 }
 
-MoveVector<256> Board::legalMoves() {
-  if (isCheck()) {
-    return produceUncheckMoves();
+template <Color C>
+void Board::_generateQuiets(MoveVector<256> &moves, u64 from) {
+  // non-capturing, non-promoting moves of pieces in from, castles included
+  // assumes not in check
+  const Color color = C;
+  const int sRow = C == White ? 1 : 6;
+  const int pRow = C == White ? 6 : 1;
+  u64 occ = occupancy();
+  u64 pawns = bitboard[W_Pawn + 6 * C] & from;
+  u64 pieces = from & ~pawns;
+
+  while (pieces) {
+    int s = bitscanForward(pieces);
+    pieces &= pieces - 1;
+    u64 targets = attackMap[s] & ~occ;
+    while (targets) {
+      int d = bitscanForward(targets);
+      targets &= targets - 1;
+      Move mv(s, d, MoveTypeCode::Default);
+      if (_verifyLegal<C>(mv)) {
+        moves.push_back(mv);
+      }
+    }
   }
 
-  MoveVector<256> v;
-  LazyMovegen movegen(occupancy(turn()), attackMap);
-  Move mv = nextMove(movegen);
-  while (mv.notNull()) {
-    v.push_back(mv);
-    mv = nextMove(movegen);
+  while (pawns) {
+    int s = bitscanForward(pawns);
+    pawns &= pawns - 1;
+    int row = intToRow(s);
+    u64 singleMove = PAWN_MOVE_CACHE[s][color] & ~occ;
+    if (!singleMove || row == pRow) {
+      continue;
+    }
+    Move mv(s, u64ToIndex(singleMove), MoveTypeCode::Default);
+    if (!_verifyLegal<C>(mv)) {
+      continue; // pinned, so the double move is illegal too
+    }
+    moves.push_back(mv);
+    if (row == sRow) {
+      u64 doubleMove = PAWN_DOUBLE_CACHE[s][color] & ~occ;
+      if (doubleMove) {
+        moves.push_back(
+            Move(s, u64ToIndex(doubleMove), MoveTypeCode::DoublePawn));
+      }
+    }
+  }
+
+  u64 kingBB = bitboard[W_King + 6 * C];
+  if (from & kingBB) {
+    int kingIndex = u64ToIndex(kingBB);
+    if (_canCastle<C>(true)) {
+      moves.push_back(Move(kingIndex, u64ToIndex(CASTLE_LONG_KING_DEST[color]),
+                           MoveTypeCode::CastleLong));
+    }
+    if (_canCastle<C>(false)) {
+      moves.push_back(Move(kingIndex,
+                           u64ToIndex(CASTLE_SHORT_KING_DEST[color]),
+                           MoveTypeCode::CastleShort));
+    }
   }
-  return v;
+}
+
+template <Color C> bool Board::_hasLegalMove() {
+  // one source square at a time, so the usual case stops at the first piece
+  MoveVector<256> moves;
+  u64 pieces = _colorOccupancy[C];
+  while (pieces) {
+    u64 src = pieces & (0 - pieces);
+    pieces &= pieces - 1;
+    _generateQuiets<C>(moves, src);
+    _generateCaptures<C>(moves, src);
+    if (!moves.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Board::hasLegalMove() {
+  return turn() == White ? _hasLegalMove<White>() : _hasLegalMove<Black>();
 }
 
 Color Board::turn() { return boardState[TURN_INDEX]; }
@@ -1855,6 +2104,12 @@ void Board::loadPosition(PieceType *piecelist, Color turn, int epIndex,
     pieceScoreEarlyGame[i] = 0;
     pieceScoreLateGame[i] = 0;
   }
+  for (int i = 0; i < 64; i++) {
+    mailbox[i] = Empty;
+  }
+  _colorOccupancy[White] = 0;
+  _colorOccupancy[Black] = 0;
+  _occupied = 0;
   _zobristHash = 0; // ZERO OUT
 
   for (int i = 0; i < 64; i++) {
@@ -1881,11 +2136,12 @@ void Board::loadPosition(PieceType *piecelist, Color turn, int epIndex,
   _setCastlingPrivileges(Black, blong, bshort);
 
   stack.clear();
-  _pseudoStack.clear();
 
   _generatePseudoLegal();
 
   _status = BoardStatus::NotCalculated;
+  _hasLegalityInfo = false;
+  _hasCheckInfo = false;
 }
 
 void Board::reset() {
@@ -1897,3 +2153,219 @@ void Board::reset() {
   kingStartingPositions[Black] = u64FromIndex(60);
   loadPosition(CLASSICAL_BOARD, White, -1, 1, 1, 1, 1, 0, 0);
 }
+
+Position Board::position() {
+  Position pos;
+  for (PieceType p = 0; p < 12; p++) {
+    pos.bitboard[p] = bitboard[p];
+  }
+  pos.colorOccupancy[White] = _colorOccupancy[White];
+  pos.colorOccupancy[Black] = _colorOccupancy[Black];
+  pos.key = _zobristHash;
+  for (int i = 0; i < 64; i++) {
+    pos.mailbox[i] = mailbox[i];
+  }
+  pos.turn = turn();
+  pos.epIndex = boardState[EN_PASSANT_INDEX];
+  pos.castling = 0;
+  for (int i = 0; i < 4; i++) {
+    pos.castling |= boardState[W_LONG_INDEX + i] << i;
+  }
+  pos.halfmove = boardState[HALFMOVE_INDEX];
+  return pos;
+}
+
+void Position::_addPiece(PieceType p, int index) {
+  u64 location = u64FromIndex(index);
+  bitboard[p] |= location;
+  colorOccupancy[p / 6] |= location;
+  mailbox[index] = p;
+  key ^= ZOBRIST_HASHES[64 * p + index];
+}
+
+void Position::_removePiece(PieceType p, int index) {
+  u64 location = u64FromIndex(index);
+  bitboard[p] &= ~location;
+  colorOccupancy[p / 6] &= ~location;
+  mailbox[index] = Empty;
+  key ^= ZOBRIST_HASHES[64 * p + index];
+}
+
+bool Position::isAttacked(int index, Color byWho) const {
+  int offset = 6 * byWho;
+  u64 occ = occupancy();
+  return (PAWN_CAPTURE_CACHE[index][flipColor(byWho)] &
+          bitboard[W_Pawn + offset]) ||
+         (KNIGHT_MOVE_CACHE[index] & bitboard[W_Knight + offset]) ||
+         (KING_MOVE_CACHE[index] & bitboard[W_King + offset]) ||
+         (rookAttacks(index, occ) &
+          (bitboard[W_Rook + offset] | bitboard[W_Queen + offset])) ||
+         (bishopAttacks(index, occ) &
+          (bitboard[W_Bishop + offset] | bitboard[W_Queen + offset]));
+}
+
+bool Position::isCheck() const {
+  return isAttacked(bitscanForward(bitboard[W_King + 6 * turn]),
+                    flipColor(turn));
+}
+
+void Position::generate(MoveVector<256> &moves) const {
+  Color color = turn;
+  Color enemyColor = flipColor(color);
+  int offset = 6 * color;
+  u64 own = colorOccupancy[color];
+  u64 enemies = colorOccupancy[enemyColor];
+  u64 occ = own | enemies;
+
+  u64 pawns = bitboard[W_Pawn + offset];
+  while (pawns) {
+    int src = bitscanForward(pawns);
+    pawns &= pawns - 1;
+    u64 forward1 = PAWN_MOVE_CACHE[src][color] & ~occ;
+    u64 targets = (PAWN_CAPTURE_CACHE[src][color] & enemies) | forward1;
+    if (forward1 && (PAWN_DOUBLE_CACHE[src][color] & ~occ)) {
+      moves.push_back(Move(src, bitscanForward(PAWN_DOUBLE_CACHE[src][color]),
+                           MoveTypeCode::DoublePawn));
+    }
+    if (epIndex != -1 &&
+        (PAWN_CAPTURE_CACHE[src][color] & u64FromIndex(epIndex))) {
+      moves.push_back(Move(src, epIndex, MoveTypeCode::EnPassant));
+    }
+    while (targets) {
+      int dest = bitscanForward(targets);
+      targets &= targets - 1;
+      if (u64FromIndex(dest) & BACK_RANK[enemyColor]) {
+        for (int code = MoveTypeCode::QPromotion;
+             code >= MoveTypeCode::KPromotion; code--) {
+          moves.push_back(Move(src, dest, code));
+        }
+      } else {
+        moves.push_back(Move(src, dest, MoveTypeCode::Default));
+      }
+    }
+  }
+
+  for (PieceType p = W_Knight; p <= W_King; p++) {
+    u64 pieces = bitboard[p + offset];
+    while (pieces) {
+      int src = bitscanForward(pieces);
+      pieces &= pieces - 1;
+      u64 targets;
+      switch (p) {
+      case W_Knight:
+        targets = KNIGHT_MOVE_CACHE[src];
+        break;
+      case W_Bishop:
+        targets = bishopAttacks(src, occ);
+        break;
+      case W_Rook:
+        targets = rookAttacks(src, occ);
+        break;
+      case W_Queen:
+        targets = bishopAttacks(src, occ) | rookAttacks(src, occ);
+        break;
+      default:
+        targets = KING_MOVE_CACHE[src];
+      }
+      targets &= ~own;
+      while (targets) {
+        int dest = bitscanForward(targets);
+        targets &= targets - 1;
+        moves.push_back(Move(src, dest, MoveTypeCode::Default));
+      }
+    }
+  }
+
+  int kingIndex = bitscanForward(bitboard[W_King + offset]);
+  bool canLong = ((castling >> (2 * color)) & 1) &&
+                 !(CASTLE_LONG_SQUARES[color] & occ);
+  bool canShort = ((castling >> (2 * color + 1)) & 1) &&
+                  !(CASTLE_SHORT_SQUARES[color] & occ);
+  if ((canLong || canShort) && !isAttacked(kingIndex, enemyColor)) {
+    for (int isLong = 0; isLong < 2; isLong++) {
+      if (!(isLong ? canLong : canShort)) {
+        continue;
+      }
+      u64 slide = isLong ? CASTLE_LONG_KING_SLIDE[color]
+                         : CASTLE_SHORT_KING_SLIDE[color];
+      bool safe = true;
+      while (slide && safe) {
+        safe = !isAttacked(bitscanForward(slide), enemyColor);
+        slide &= slide - 1;
+      }
+      if (safe) {
+        u64 dest = isLong ? CASTLE_LONG_KING_DEST[color]
+                          : CASTLE_SHORT_KING_DEST[color];
+        moves.push_back(Move(kingIndex, bitscanForward(dest),
+                             isLong ? MoveTypeCode::CastleLong
+                                    : MoveTypeCode::CastleShort));
+      }
+    }
+  }
+}
+
+bool Position::doMove(Move mv, Position &child) const {
+  child = *this;
+  Color color = turn;
+  Color enemyColor = flipColor(color);
+  int moveType = mv.getTypeCode();
+
+  if (epIndex != -1) {
+    child.key ^= ZOBRIST_HASHES[EP_HASH_POS + intToCol(epIndex)];
+    child.epIndex = -1;
+  }
+  child.turn = enemyColor;
+  child.key ^= ZOBRIST_HASHES[SIDE_TO_MOVE_HASH_POS];
+  if (moveType == MoveTypeCode::Null) {
+    return true;
+  }
+
+  int src = mv.getSrcIndex();
+  int dest = mv.getDestIndex();
+  PieceType mover = mailbox[src];
+  PieceType captured = mailbox[dest];
+
+  child.halfmove =
+      (mover % 6 == W_Pawn || captured != Empty) ? 0 : halfmove + 1;
+
+  if (captured != Empty) {
+    child._removePiece(captured, dest);
+  } else if (moveType == MoveTypeCode::EnPassant) {
+    child._removePiece(W_Pawn + 6 * enemyColor,
+                       bitscanForward(PAWN_MOVE_CACHE[dest][enemyColor]));
+  }
+  child._removePiece(mover, src);
+  child._addPiece(mv.isPromotion() ? mv.getPromotingPiece(color) : mover,
+                  dest);
+
+  if (moveType == MoveTypeCode::CastleLong) {
+    child._removePiece(W_Rook + 6 * color, color == White ? 0 : 56);
+    child._addPiece(W_Rook + 6 * color,
+                    bitscanForward(CASTLE_LONG_ROOK_DEST[color]));
+  } else if (moveType == MoveTypeCode::CastleShort) {
+    child._removePiece(W_Rook + 6 * color, color == White ? 7 : 63);
+    child._addPiece(W_Rook + 6 * color,
+                    bitscanForward(CASTLE_SHORT_ROOK_DEST[color]));
+  } else if (moveType == MoveTypeCode::DoublePawn &&
+             (ONE_ADJACENT_CACHE[dest] & bitboard[W_Pawn + 6 * enemyColor])) {
+    // like Board, only set when a pawn is there to take it
+    child.epIndex = bitscanForward(PAWN_MOVE_CACHE[dest][enemyColor]);
+    child.key ^= ZOBRIST_HASHES[EP_HASH_POS + intToCol(child.epIndex)];
+  }
+
+  if (castling) {
+    // a right goes as soon as anything moves from or onto its king or rook
+    const int CORNERS[4] = {0, 7, 56, 63};
+    const int KINGS[2] = {4, 60};
+    for (int i = 0; i < 4; i++) {
+      if (((castling >> i) & 1) &&
+          (src == CORNERS[i] || dest == CORNERS[i] || src == KINGS[i / 2])) {
+        child.castling &= ~(1 << i);
+        child.key ^= ZOBRIST_HASHES[W_LONG_HASH_POS + i];
+      }
+    }
+  }
+
+  return !child.isAttacked(bitscanForward(child.bitboard[W_King + 6 * color]),
+                           enemyColor);
+}
@@ -134,43 +134,62 @@ std::string Board::vectorize() { // return a vector representation of the board
   return res;
 }
 
+u64 Board::perft(int depth) {
+  // bulk counting: the leaf moves are counted, never made
+  if (depth == 0) {
+    return 1;
+  }
+  MoveVector<256> moves = legalMoves();
+  if (depth == 1) {
+    return moves.size();
+  }
+  u64 nodes = 0;
+  for (int i = 0; i < moves.size(); i++) {
+    makeMove(moves[i]);
+    nodes += perft(depth - 1);
+    unmakeMove();
+  }
+  return nodes;
+}
+
 void Board::perft(int depth, PerftCounter &pcounter) {
   if (depth == 0) {
     return;
   }
 
   MoveVector<256> moves = legalMoves();
-  int s = moves.size();
-  u64 occ = occupancy();
-  for (int i = 0; i < s; i++) {
-    Move mv = moves[i];
-    if (depth == 1) {
-      pcounter.nodes += 1;
-      if (mv.isCastle()) {
-        pcounter.castles += 1;
-      }
-      if (mv.isPromotion()) {
-        pcounter.promotions += 1;
-      }
-      if (isCheckingMove(mv)) {
-        pcounter.checks += 1;
-      }
-      if (mv.getDest() & occ) {
-        pcounter.captures += 1;
-      }
-      if (mv.getTypeCode() == MoveTypeCode::EnPassant) {
-        pcounter.ep += 1;
-        pcounter.captures += 1;
-      }
+  for (int i = 0; i < moves.size(); i++) {
+    perftMove(moves[i], depth, pcounter);
+  }
+}
+
+void Board::perftMove(Move mv, int depth, PerftCounter &pcounter) {
+  if (depth == 1) {
+    pcounter.nodes += 1;
+    if (mv.isCastle()) {
+      pcounter.castles += 1;
     }
-    makeMove(mv);
-    if (depth == 1) {
-      auto s = status();
-      if (s == BoardStatus::WhiteWin || s == BoardStatus::BlackWin) {
-        pcounter.checkmates += 1;
-      }
+    if (mv.isPromotion()) {
+      pcounter.promotions += 1;
+    }
+    if (isCheckingMove(mv)) {
+      pcounter.checks += 1;
+    }
+    if (mv.getDest() & occupancy()) {
+      pcounter.captures += 1;
+    }
+    if (mv.getTypeCode() == MoveTypeCode::EnPassant) {
+      pcounter.ep += 1;
+      pcounter.captures += 1;
+    }
+  }
+  makeMove(mv);
+  if (depth == 1) {
+    auto s = status();
+    if (s == BoardStatus::WhiteWin || s == BoardStatus::BlackWin) {
+      pcounter.checkmates += 1;
     }
-    perft(depth - 1, pcounter);
-    unmakeMove();
   }
+  perft(depth - 1, pcounter);
+  unmakeMove();
 }
@@ -1,3 +1,4 @@
+#include <cctype>
 #include <fstream>
 #include <game/glob.hpp>
 
@@ -172,14 +173,6 @@ void dump64(u64 x) { // Checked, should work
   std::cout << "\n";
 }
 
-int distToClosestCorner(int r, int c) {
-  int dc00 = abs(r - 0) + abs(c - 0);
-  int dc07 = abs(r - 0) + abs(c - 7);
-  int dc70 = abs(r - 7) + abs(c - 0);
-  int dc77 = abs(r - 7) + abs(c - 7);
-  return min(min(dc00, dc07), min(dc70, dc77));
-}
-
 std::string yesorno(bool b) { return b ? "yes" : "no"; }
 
 std::vector<std::string> tokenize(std::string instring) {
@@ -189,3 +182,16 @@ std::vector<std::string> tokenize(std::string instring) {
        std::istream_iterator<std::string>(), back_inserter(tokens));
   return tokens;
 }
+
+std::string epdFen(const std::string &line) {
+  auto fields = tokenize(line.substr(0, line.find(';')));
+  if (fields.empty() || fields[0][0] == '#') {
+    return "";
+  }
+  std::string fen = fields[0];
+  for (int i = 1; i < 6; i++) {
+    bool given = i < (int)fields.size() && (i < 4 || isdigit(fields[i][0]));
+    fen += " " + (given ? fields[i] : i == 4 ? "0" : "1");
+  }
+  return fen;
+}
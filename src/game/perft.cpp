@@ -0,0 +1,269 @@
+#include <chrono>
+#include <fstream>
+#include <game/perft.hpp>
+#include <thread>
+
+namespace {
+
+void worker(Board board, int depth, bool detailed, Perft::HashTable *table,
+            std::vector<Perft::RootResult> &results,
+            std::atomic<int> &nextIndex) {
+  // root moves are handed out one at a time, so a few heavy subtrees
+  // don't leave the other threads idle
+  for (int i = nextIndex++; i < (int)results.size(); i = nextIndex++) {
+    Perft::RootResult &result = results[i];
+    if (detailed) {
+      board.perftMove(result.mv, depth, result.counter);
+    } else {
+      board.makeMove(result.mv);
+      if (table != nullptr && table->enabled()) {
+        result.counter.nodes = Perft::hashed(board, depth - 1, *table);
+      } else {
+        result.counter.nodes = board.perft(depth - 1);
+      }
+      board.unmakeMove();
+    }
+  }
+}
+
+u64 copyMakeNodes(Position *plies, int depth) {
+  // plies[0] is this node, children are written into plies[1]
+  MoveVector<256> moves;
+  plies[0].generate(moves);
+  u64 nodes = 0;
+  for (int i = 0; i < moves.size(); i++) {
+    if (!plies[0].doMove(moves[i], plies[1])) {
+      continue;
+    }
+    nodes += depth == 1 ? 1 : copyMakeNodes(plies + 1, depth - 1);
+  }
+  return nodes;
+}
+
+// Compares isCheckingMove with making the move and testing for check, for
+// every legal move in the tree of depth plies below board. Reports each
+// disagreement to out and returns how many there were.
+int checkMismatches(Board &board, int depth, std::ostream &out) {
+  int mismatches = 0;
+  auto moves = board.legalMoves();
+  for (int i = 0; i < moves.size(); i++) {
+    Move mv = moves[i];
+    bool predicted = board.isCheckingMove(mv);
+    board.makeMove(mv);
+    bool actual = board.isCheck();
+    if (depth > 1) {
+      mismatches += checkMismatches(board, depth - 1, out);
+    }
+    board.unmakeMove();
+    if (predicted != actual) {
+      mismatches++;
+      out << "FAIL " << board.fen() << " move " << mv.moveToUCIAlgebraic()
+          << (predicted ? " reported as check" : " check missed") << "\n";
+    }
+  }
+  return mismatches;
+}
+
+} // namespace
+
+void Perft::HashTable::resize(int megabytes) {
+  _entries.reset();
+  _mask = 0;
+  if (megabytes <= 0) {
+    return;
+  }
+  u64 count = 1;
+  while (count * 2 * sizeof(Entry) <= (u64)megabytes * 1024 * 1024) {
+    count *= 2;
+  }
+  _entries.reset(new Entry[count]);
+  _mask = count - 1;
+  clear();
+}
+
+void Perft::HashTable::clear() {
+  if (!enabled()) {
+    return;
+  }
+  for (u64 i = 0; i <= _mask; i++) {
+    _entries[i].check.store(0, std::memory_order_relaxed);
+    _entries[i].nodes.store(0, std::memory_order_relaxed);
+  }
+}
+
+int Perft::HashTable::megabytes() {
+  if (!enabled()) {
+    return 0;
+  }
+  return (int)(((_mask + 1) * sizeof(Entry)) / (1024 * 1024));
+}
+
+bool Perft::HashTable::probe(u64 key, u64 &outNodes) {
+  Entry &entry = _entries[key & _mask];
+  u64 nodes = entry.nodes.load(std::memory_order_relaxed);
+  u64 check = entry.check.load(std::memory_order_relaxed);
+  if ((check ^ nodes) != key || nodes == 0) {
+    return false;
+  }
+  outNodes = nodes;
+  return true;
+}
+
+void Perft::HashTable::save(u64 key, u64 nodes) {
+  Entry &entry = _entries[key & _mask];
+  entry.check.store(key ^ nodes, std::memory_order_relaxed);
+  entry.nodes.store(nodes, std::memory_order_relaxed);
+}
+
+u64 Perft::key(Board &board, int depth) {
+  // the same position at another depth has another count
+  return board.zobrist() ^ ((u64)depth * 0x9E3779B97F4A7C15ULL);
+}
+
+u64 Perft::copyMake(const Position &root, int depth) {
+  if (depth <= 0) {
+    return 1;
+  }
+  std::vector<Position> plies(depth + 1);
+  plies[0] = root;
+  return copyMakeNodes(plies.data(), depth);
+}
+
+u64 Perft::hashed(Board &board, int depth, HashTable &table) {
+  if (depth <= 1) {
+    return board.perft(depth); // bulk counted, cheaper than a lookup
+  }
+  u64 k = key(board, depth);
+  u64 nodes = 0;
+  if (table.probe(k, nodes)) {
+    return nodes;
+  }
+  MoveVector<256> moves = board.legalMoves();
+  for (int i = 0; i < moves.size(); i++) {
+    board.makeMove(moves[i]);
+    nodes += hashed(board, depth - 1, table);
+    board.unmakeMove();
+  }
+  table.save(k, nodes);
+  return nodes;
+}
+
+std::vector<Perft::RootResult> Perft::divide(Board &board, int depth,
+                                             int threads, bool detailed,
+                                             HashTable *table) {
+  std::vector<RootResult> results;
+  if (depth < 1) {
+    return results;
+  }
+  MoveVector<256> moves = board.legalMoves();
+  for (int i = 0; i < moves.size(); i++) {
+    results.push_back(RootResult(moves[i]));
+  }
+
+  threads = max(1, min(threads, moves.size()));
+  std::atomic<int> nextIndex{0};
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++) {
+    pool.push_back(std::thread(worker, board, depth, detailed, table,
+                               std::ref(results), std::ref(nextIndex)));
+  }
+  for (auto &th : pool) {
+    th.join();
+  }
+  return results;
+}
+
+PerftCounter Perft::total(const std::vector<RootResult> &results) {
+  PerftCounter sum;
+  for (const auto &result : results) {
+    sum.add(result.counter);
+  }
+  return sum;
+}
+
+bool Perft::suite(const std::string &path, int threads, int maxDepth,
+                  HashTable *table, std::ostream &out) {
+  std::ifstream file(path);
+  if (!file) {
+    out << "cannot open " << path << "\n";
+    return false;
+  }
+  Board board;
+  int checks = 0;
+  int failures = 0;
+  u64 totalNodes = 0;
+  int totalTime = 0;
+  for (std::string line; std::getline(file, line);) {
+    size_t split = line.find(';');
+    std::string fen = epdFen(line);
+    if (fen.empty() || split == std::string::npos) {
+      continue;
+    }
+    while (split != std::string::npos) {
+      size_t next = line.find(';', split + 1);
+      auto expect = tokenize(line.substr(split + 1, next - split - 1));
+      split = next;
+      if (expect.size() < 2 || expect[0][0] != 'D') {
+        continue;
+      }
+      int depth = std::stoi(expect[0].substr(1));
+      u64 expected = std::stoull(expect[1]);
+      if (maxDepth > 0 && depth > maxDepth) {
+        continue;
+      }
+      board.loadPosition(fen);
+      if (table != nullptr) {
+        table->clear();
+      }
+      auto start = std::chrono::high_resolution_clock::now();
+      u64 nodes = total(divide(board, depth, threads, false, table)).nodes;
+      auto stop = std::chrono::high_resolution_clock::now();
+      int time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     stop - start)
+                     .count();
+      checks++;
+      totalNodes += nodes;
+      totalTime += time;
+      bool ok = nodes == expected;
+      if (!ok) {
+        failures++;
+      }
+      out << (ok ? "ok   " : "FAIL ") << fen << " d" << depth << " nodes "
+          << nodes;
+      if (!ok) {
+        out << " expected " << expected;
+      }
+      out << " time " << time << " ms mnps "
+          << (double)nodes / ((double)max(time, 1) * 1000.0) << "\n";
+    }
+  }
+  out << "passed " << checks - failures << "/" << checks << " nodes "
+      << totalNodes << " time " << totalTime << " ms mnps "
+      << (double)totalNodes / ((double)max(totalTime, 1) * 1000.0) << "\n";
+  return failures == 0;
+}
+
+bool Perft::checkSuite(const std::string &path, int depth, std::ostream &out) {
+  std::ifstream file(path);
+  if (!file) {
+    out << "cannot open " << path << "\n";
+    return false;
+  }
+  Board board;
+  int positions = 0;
+  int failures = 0;
+  for (std::string line; std::getline(file, line);) {
+    std::string fen = epdFen(line);
+    if (fen.empty()) {
+      continue;
+    }
+    board.loadPosition(fen);
+    int mismatches = checkMismatches(board, depth, out);
+    positions++;
+    if (mismatches > 0) {
+      failures++;
+    }
+  }
+  out << "passed " << positions - failures << "/" << positions << "\n";
+  return failures == 0;
+}